@@ -0,0 +1,194 @@
+/// @file median_bench.c
+/// @brief Cycle count benchmark of the Huba median filter
+/// @details Runs the original insertion sort median of main.c (on float
+/// temperatures) and huba713_median (on centidegrees) on the same sample
+/// windows and stores the cycle counts in `results`. The float temperature
+/// conversions the drivers used before are timed against the fixed point ones
+/// in `conversions`. Flash this image and read `results` and `conversions`
+/// with the debugger (see bloom.yaml) after `bench_done` has been set.
+///
+/// TCB0 counts CLK_PER without prescaler, so the counts are CPU cycles. The
+/// overhead of reading the counter is measured first and subtracted.
+///
+/// Flash: the map file of this image (median-bench*.map) lists the
+/// size of every function linked in; compare huba713_median and its helpers
+/// against insertion_sort_u16 + insertion_sort_f, and the float conversions
+/// with the soft-float routines they pull in (__mulsf3, __floatunsisf, ...)
+/// against the fixed point ones. avr-size of the firmware image gives the
+/// total, to compare with a build from before the fixed point change.
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perif/huba713.h"
+
+/// @brief Cycle counts of a single window
+typedef struct {
+    uint16_t legacy; // insertion_sort_u16 + insertion_sort_f as in main.c
+    uint16_t median; // huba713_median
+} bench_result_t;
+
+/// @brief Cycle counts of the temperature conversions, summed over all inputs
+typedef struct {
+    uint32_t huba_float;    // 0.784 * t - 50
+    uint32_t huba_fixed;    // huba713_read
+    uint32_t ds18b20_float; // sign and magnitude * 0.0625
+    uint32_t ds18b20_fixed; // ds18b20_fetch
+} bench_conversion_t;
+
+/// @brief Windows: sorted, reversed, random, random with 3 dropped frames
+#define BENCH_WINDOWS 4
+
+volatile bench_result_t results[BENCH_WINDOWS];
+volatile bench_conversion_t conversions;
+volatile uint16_t overhead;
+volatile uint8_t bench_done = 0;
+
+/* Function to sort an array using insertion sort*/
+void insertion_sort_u16(uint16_t arr[], int n) {
+    int i, key, j;
+    for (i = 1; i < n; i++) {
+        key = arr[i];
+        j = i - 1;
+
+        /* Move elements of arr[0..i-1], that are
+        greater than key, to one position ahead
+        of their current position */
+        while (j >= 1 && arr[j] > key) {
+            arr[j + 1] = arr[j];
+            j = j - 1;
+        }
+        arr[j + 1] = key;
+    }
+}
+
+/* Function to sort an array using insertion sort*/
+void insertion_sort_f(float arr[], int n) {
+    int i, key, j;
+    for (i = 1; i < n; i++) {
+        key = arr[i];
+        j = i - 1;
+
+        /* Move elements of arr[0..i-1], that are
+        greater than key, to one position ahead
+        of their current position */
+        while (j >= 1 && arr[j] > key) {
+            arr[j + 1] = arr[j];
+            j = j - 1;
+        }
+        arr[j + 1] = key;
+    }
+}
+
+static inline uint16_t cycles(void) { return TCB0.CNT; }
+
+// Conversions as in the drivers, kept out of line so they are timed as calls
+__attribute__((noinline)) float huba_float(uint8_t t) {
+    return (0.784 * (float)t) - 50;
+}
+
+__attribute__((noinline)) int16_t huba_fixed(uint8_t t) {
+    return (int16_t)(t * 78U + t * 2U / 5) - 5000;
+}
+
+__attribute__((noinline)) float ds18b20_float(uint16_t raw) {
+    uint8_t sign = raw >> 15;
+    float temp = (float)(raw & 0x7FFF) * 0.0625;
+    return temp * (sign ? -1 : 1);
+}
+
+__attribute__((noinline)) int16_t ds18b20_fixed(int16_t raw) {
+    return raw * 6 + (raw >> 2);
+}
+
+static void fill(uint16_t *pressure, float *legacy, int16_t *temperature,
+                 uint8_t window) {
+    for (uint8_t i = 0; i < HUBA_MEDIAN_COUNT; i++) {
+        uint16_t v;
+        switch (window) {
+        case 0:
+            v = 3000 + i;
+            break;
+        case 1:
+            v = 3000 + HUBA_MEDIAN_COUNT - i;
+            break;
+        default:
+            v = 3000 + (rand() & 0x3F);
+            break;
+        }
+        pressure[i] = v;
+        legacy[i] = (0.784 * (float)(v & 0xFF)) - 50;
+        temperature[i] = huba_fixed(v & 0xFF);
+    }
+}
+
+/// @brief Time the conversions over the whole Huba and DS18B20 range
+static void bench_conversions(void) {
+    volatile float f;
+    volatile int16_t c;
+    uint16_t start;
+
+    conversions.huba_float = 0;
+    conversions.huba_fixed = 0;
+    for (uint16_t t = 0; t < 256; t++) {
+        start = cycles();
+        f = huba_float(t);
+        conversions.huba_float += (uint16_t)(cycles() - start - overhead);
+        start = cycles();
+        c = huba_fixed(t);
+        conversions.huba_fixed += (uint16_t)(cycles() - start - overhead);
+    }
+
+    conversions.ds18b20_float = 0;
+    conversions.ds18b20_fixed = 0;
+    // -55 to 125 degrees in 1/16 degree steps
+    for (int16_t raw = -55 * 16; raw <= 125 * 16; raw++) {
+        start = cycles();
+        f = ds18b20_float(raw);
+        conversions.ds18b20_float += (uint16_t)(cycles() - start - overhead);
+        start = cycles();
+        c = ds18b20_fixed(raw);
+        conversions.ds18b20_fixed += (uint16_t)(cycles() - start - overhead);
+    }
+    (void)f;
+    (void)c;
+}
+
+int main() {
+    uint16_t pressure[HUBA_MEDIAN_COUNT];
+    float legacy[HUBA_MEDIAN_COUNT];
+    int16_t temperature[HUBA_MEDIAN_COUNT];
+    uint16_t start;
+
+    TCB0.CCMP = 0xFFFF;
+    TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+
+    start = cycles();
+    overhead = cycles() - start;
+
+    for (uint8_t w = 0; w < BENCH_WINDOWS; w++) {
+        uint8_t n = (w == 3) ? HUBA_MEDIAN_COUNT - 3 : HUBA_MEDIAN_COUNT;
+
+        srand(w);
+        fill(pressure, legacy, temperature, w);
+        start = cycles();
+        insertion_sort_u16(pressure, n);
+        insertion_sort_f(legacy, n);
+        results[w].legacy = cycles() - start - overhead;
+
+        srand(w);
+        fill(pressure, legacy, temperature, w);
+        start = cycles();
+        huba713_median(pressure, temperature, n);
+        results[w].median = cycles() - start - overhead;
+    }
+
+    bench_conversions();
+
+    bench_done = 1;
+    while (1)
+        ;
+}
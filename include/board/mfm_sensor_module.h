@@ -32,6 +32,15 @@
 #define ZACWIRE_PORT PORTA
 #define ZACWIRE_PIN PIN6_bm
 #define ZACWIRE_PINp PIN6_bp
+// The ZACwire pin reaches the TCB0 capture input through the event system
+#define ZACWIRE_EVENT_GENERATOR EVSYS_ASYNCCH0_PORTA_PIN6_gc
+#define ZACWIRE_EVENT_CHANNEL EVSYS.ASYNCCH0
+#define ZACWIRE_EVENT_USER EVSYS.ASYNCUSER0 // TCB0
+#define ZACWIRE_EVENT_USER_CHANNEL EVSYS_ASYNCUSER0_ASYNCCH0_gc
+
+// SMB-RX net, level shifted to SMBALERT on the bus connector
+#define DATA_READY_PORT PORTA
+#define DATA_READY_PIN PIN1_bm
 
 #define TEST_PORT PORTA
 #define TEST_PIN PIN2_bm
@@ -16,33 +16,68 @@
 #define OW_PIN PIN7
 #endif
 
-// Standard OneWire speeds in microseconds
+/// @brief Virtual port of OW_PORT, its single cycle bit instructions keep the
+/// slot timing exact
+#ifndef OW_VPORT
+#define OW_VPORT VPORTA
+#endif
+
+// Standard OneWire speeds in nanoseconds
 // Duration of pull down before writing/reading a bit
-#define OW_TIME_A 6
+#define OW_TIME_A 6000
 // Duration of holding 1/0 bit (high/low)
-#define OW_TIME_B 64
+#define OW_TIME_B 64000
 // Duration of writing zero
-#define OW_TIME_C 60
+#define OW_TIME_C 60000
 // Duration to wait after write/read to allow recharge
-#define OW_TIME_D 10
+#define OW_TIME_D 10000
 // Duration after start to sample line
-#define OW_TIME_E 9
+#define OW_TIME_E 9000
 // Duration to wait after sample
-#define OW_TIME_F 55
-// Only used in overdrive mode
+#define OW_TIME_F 55000
+// Duration to wait before a reset
 #define OW_TIME_G 0
 // Duration of reset pulldown
-#define OW_TIME_H 480
+#define OW_TIME_H 480000
 // Duration after reset to sample presence
-#define OW_TIME_I 70
+#define OW_TIME_I 70000
 // Duration after sample to wait
-#define OW_TIME_J 410
+#define OW_TIME_J 410000
+
+// Overdrive OneWire speeds in nanoseconds, same meaning as above
+#define OW_OD_TIME_A 1000
+#define OW_OD_TIME_B 7500
+#define OW_OD_TIME_C 7500
+#define OW_OD_TIME_D 2500
+#define OW_OD_TIME_E 1000
+#define OW_OD_TIME_F 7000
+#define OW_OD_TIME_G 2500
+#define OW_OD_TIME_H 70000
+#define OW_OD_TIME_I 8500
+#define OW_OD_TIME_J 40000
+
+/// @brief Bus speed, see ow_setSpeed
+#define OW_SPEED_STANDARD 0
+#define OW_SPEED_OVERDRIVE 1
 
 // OneWire ROM Commands
 #define OW_CMD_SKIP 0xCC
 #define OW_CMD_READ 0x33
 #define OW_CMD_SEARCH 0xF0
 #define OW_CMD_MATCH 0x55
+#define OW_CMD_OVERDRIVE_SKIP 0x3C
+#define OW_CMD_OVERDRIVE_MATCH 0x69
+
+/// @brief Number of bytes in a ROM code (family, serial, CRC)
+#define OW_ROM_LENGTH 8
+
+/// @brief State of a ROM search, see ow_searchNext
+typedef struct ow_search
+{
+  uint8_t rom[OW_ROM_LENGTH]; // ROM of the last device found
+  uint8_t last_discrepancy;
+  uint8_t done;
+} ow_search_t;
 
 #ifdef __cplusplus
 extern "C"
@@ -53,6 +88,13 @@ extern "C"
   void ow_write(uint8_t);
   uint8_t ow_readBit(void);
   uint8_t ow_read(void);
+  void ow_writeBit(uint8_t);
+  uint8_t ow_crc8(const uint8_t *data, uint8_t len);
+  int8_t ow_select(const uint8_t *rom);
+  void ow_setSpeed(uint8_t speed);
+  int8_t ow_overdriveSkip(void);
+  void ow_searchInit(ow_search_t *search);
+  uint8_t ow_searchNext(ow_search_t *search);
 
 #ifdef __cplusplus
 }
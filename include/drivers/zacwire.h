@@ -7,8 +7,34 @@
 #ifndef ZACWIRE_H
 #define ZACWIRE_H
 
+/// @brief Longest frame zacwire_read accepts
+#ifndef ZACWIRE_MAX_BYTES
+#define ZACWIRE_MAX_BYTES 3
+#endif
+
+/// @brief Milliseconds zacwire_read waits for a complete frame
+#ifndef ZACWIRE_TIMEOUT
+#define ZACWIRE_TIMEOUT 100
+#endif
+
+// zacwire_read errors
+#define ZACWIRE_ERR_PARITY (-1)  // A byte failed its parity bit
+#define ZACWIRE_ERR_TIMEOUT (-2)  // A frame stopped before its last edge
+#define ZACWIRE_ERR_GLITCH (-3)   // A pulse too short or long to be a bit
+#define ZACWIRE_ERR_NO_FRAME (-4) // No idle bus or no frame before the timeout
+
+/// @brief Frames read and errors per class
+typedef struct zacwire_stats {
+    uint16_t frames; // Valid frames
+    uint16_t parity;
+    uint16_t timeout;
+    uint16_t glitch;
+    uint16_t missing; // ZACWIRE_ERR_NO_FRAME
+} zacwire_stats_t;
 
 void zacwire_init(void);
 int8_t zacwire_read(uint8_t *data, uint8_t count);
+void zacwire_getStats(zacwire_stats_t *s);
+void zacwire_clearStats(void);
 
 #endif // ZACWIRE_H
@@ -3,13 +3,10 @@
 
 #include <stdint.h>
 
+/// @brief Size of the buffer holding written bytes and small responses; larger
+/// responses are streamed with twi_transmit or twi_transmitWith
 #ifndef TWI_BUFFER_LENGTH
-#define TWI_BUFFER_LENGTH 32
-#endif
-
-#ifndef TWI_CMD_COUNT
-#warning "TWI_CMD_COUNT must be defined manually to use memory efficiently"
-#define TWI_CMD_COUNT 2
+#define TWI_BUFFER_LENGTH 16
 #endif
 
 typedef struct
@@ -18,7 +15,46 @@ typedef struct
   void (*handler)(uint8_t *data, uint8_t len);
 } twi_cmd_t;
 
-extern twi_cmd_t twi_cmds[];
+/// @brief Accepted commands, defined by TWI_DEFINE_COMMANDS
+extern const twi_cmd_t twi_cmds[];
+/// @brief Index + 1 into twi_cmds for every command byte, 0 if not accepted
+extern const uint8_t twi_cmd_lut[256];
+
+#define TWI_CMD_ENUM_(cmd, fn) twi_cmd_idx_##fn,
+#define TWI_CMD_ENTRY_(cmd, fn) {(cmd), &fn},
+#define TWI_CMD_LUT_(cmd, fn) [(cmd)] = twi_cmd_idx_##fn + 1,
+#define TWI_CMD_CASE_(cmd, fn) case (cmd):
+
+/// @brief Define the accepted commands from an X-macro list
+/// @details `list(X)` must expand X(cmd, handler) once per command, e.g.
+///
+///     #define MY_COMMANDS(X) X(0x10, cmd_10_handler) X(0x11, cmd_11_handler)
+///     TWI_DEFINE_COMMANDS(MY_COMMANDS)
+///
+/// This generates the handler table and a 256 entry lookup table
+/// in flash, so the ISR finds a handler with a single load whatever the number
+/// of commands. A command byte listed twice fails to compile (duplicate case).
+#define TWI_DEFINE_COMMANDS(list)                                             \
+  enum                                                                        \
+  {                                                                           \
+    list(TWI_CMD_ENUM_) twi_cmd_idx_count_                                    \
+  };                                                                          \
+  const twi_cmd_t twi_cmds[] = {list(TWI_CMD_ENTRY_)};                        \
+  _Static_assert(twi_cmd_idx_count_ < 0xFF,                                   \
+                 "twi_cmd_lut holds the command index + 1 in a byte");        \
+  const uint8_t twi_cmd_lut[256] = {list(TWI_CMD_LUT_)};                      \
+  static inline void twi_cmd_unique_(uint8_t c)                               \
+  {                                                                           \
+    switch (c)                                                                \
+    {                                                                         \
+      list(TWI_CMD_CASE_) default : break;                                    \
+    }                                                                         \
+  }
+
+/// @brief Produces the next byte of a streamed response, called from the ISR
+typedef uint8_t (*twi_producer_t)(void);
+/// @brief Called from the ISR once a response has been read
+typedef void (*twi_transmitted_t)(void);
 
 #ifdef __cplusplus
 extern "C"
@@ -28,6 +64,9 @@ extern "C"
   void twi_init(uint8_t addr, uint8_t enable_gc);
   void twi_ack(void);
   void twi_nack(void);
+  void twi_transmit(const void *data, uint16_t len);
+  void twi_transmitWith(twi_producer_t producer, uint16_t len);
+  void twi_onTransmitted(twi_transmitted_t done);
 
 #ifdef __cplusplus
 }
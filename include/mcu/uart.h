@@ -5,14 +5,38 @@
 #ifndef USART_H
 #define USART_H
 #include <avr/io.h>
+#include <stdint.h>
 
 #define MAX_RX_LINE_LENGTH 10
 
-void uart_init(void);
+/// @brief Size of the interrupt-fed receive buffer, must be a power of two
+#ifndef UART_RX_BUFFER_LENGTH
+#define UART_RX_BUFFER_LENGTH 32
+#endif
+
+/// @brief Size of the interrupt-emptied transmit buffer, must be a power of
+/// two
+#ifndef UART_TX_BUFFER_LENGTH
+#define UART_TX_BUFFER_LENGTH 32
+#endif
+
+/// @brief Highest baud rate in normal mode, the BAUD register must be >= 64
+#define UART_MAX_BAUD (F_CPU * 4 / 64)
+
+/// @brief Returned by uart_read when the deadline passed
+#define UART_TIMEOUT (-1)
+
+void uart_init(uint32_t baud);
 void uart_sendChar(char c);
 void uart_sendString(char *str);
-char* uart_readline(void);
+uint8_t uart_txDone(void);
+uint8_t uart_waitTx(uint32_t deadline);
+char* uart_readline(uint32_t deadline);
 void uart_disable(void);
-uint8_t uart_read(void);
+void uart_suspend(void);
+int16_t uart_read(uint32_t deadline);
+uint8_t uart_available(void);
+uint8_t uart_lineAvailable(void);
+void uart_flush(void);
 
 #endif // USART_H
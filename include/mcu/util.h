@@ -1,8 +1,22 @@
 #if !defined(_MCU_UTIL_H_)
 #define _MCU_UTIL_H_
 
+#include <avr/io.h>
 #include <stdint.h>
 
+/// @brief Longest constant delay_us that is compiled into a cycle loop;
+/// longer or variable delays poll TCB1, which interrupts cannot stretch
+#ifndef DELAY_CYCLES_MAX_US
+#define DELAY_CYCLES_MAX_US 1000
+#endif
+
+// TCB1 runs free at the CPU clock, one tick per cycle; it wraps every 65536
+// ticks (~19.7 ms at 3.33 MHz) and stops in STANDBY
+#define TICKS_PER_US_Q10 ((F_CPU * 1024UL + 500000UL) / 1000000UL)
+
+/// @brief Ticks in `us` microseconds, rounded up; folds for a constant
+#define TICKS_FROM_US(us) (((us) * (F_CPU / 1000UL) + 999UL) / 1000UL)
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -12,7 +26,34 @@ extern "C"
   uint32_t millis(void);
   uint32_t micros(void);
   void delay_ms(uint32_t);
-  void delay_us(uint32_t);
+  void delay_ticks(uint16_t start, uint32_t ticks);
+  void delay_usTimer(uint32_t us);
+  void cpu_idle(void);
+  void cpu_idleUntil(uint32_t deadline);
+  void cpu_sleepUntil(uint32_t deadline);
+  uint8_t cpu_wakeAt(uint32_t deadline);
+
+  /// @brief Timestamp in TCB1 ticks, for intervals shorter than its period
+  /// @details Kept raw so taking it costs a register read; convert the
+  /// difference of two with tick_toUs when needed. Not for use in an ISR.
+  static inline uint16_t tick_now(void) { return TCB1.CNT; }
+
+  /// @brief Convert a tick interval to microseconds
+  static inline uint32_t tick_toUs(uint16_t ticks)
+  {
+    return ((uint32_t)ticks << 10) / TICKS_PER_US_Q10;
+  }
+
+  /// @brief Wait for `us` microseconds, busy
+  /// @details A constant up to DELAY_CYCLES_MAX_US becomes an exact cycle
+  /// loop without any call; other delays poll TCB1, at most ~1.2 s.
+  static inline __attribute__((always_inline)) void delay_us(uint32_t us)
+  {
+    if (__builtin_constant_p(us) && us <= DELAY_CYCLES_MAX_US)
+      __builtin_avr_delay_cycles(TICKS_FROM_US(us));
+    else
+      delay_usTimer(us);
+  }
 
 #ifdef __cplusplus
 }
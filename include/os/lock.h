@@ -10,7 +10,8 @@ extern "C"
 
   typedef enum os_lock
   {
-    os_lock_twi,
+    os_lock_twi,  // TWI transfer in progress
+    os_lock_uart, // UART enabled, needs the peripheral clock
     os_lock_count
   } os_lock_t;
 
@@ -2,6 +2,7 @@
 #define _OS_H_
 
 #include "lock.h"
+#include "task.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -0,0 +1,49 @@
+#if !defined(_OS_TASK_H_)
+#define _OS_TASK_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /// @brief Function executed when a task is run by os_processTasks
+  typedef void (*os_task_fn_t)(void);
+
+  typedef enum os_task_state
+  {
+    os_task_idle,    // Not queued
+    os_task_ready,   // In the ready queue, runs on the next os_processTasks
+    os_task_waiting, // In the timer list, waiting for its deadline
+  } os_task_state_t;
+
+  /// @brief Cooperative task; storage is owned by the caller (usually static)
+  typedef struct os_task
+  {
+    os_task_fn_t fn;
+    uint32_t deadline; // millis() at which a waiting task becomes ready
+    volatile uint8_t state;
+    struct os_task *next;
+  } os_task_t;
+
+/// @brief Static initializer for an os_task_t
+#define OS_TASK_INIT(f)                                                        \
+  {.fn = (f), .deadline = 0, .state = os_task_idle, .next = 0}
+
+  void os_taskInit(os_task_t *t, os_task_fn_t fn);
+  void os_taskPost(os_task_t *t);
+  void os_taskPostDelayed(os_task_t *t, uint32_t ms);
+  void os_taskPostAt(os_task_t *t, uint32_t deadline);
+  void os_taskCancel(os_task_t *t);
+  uint8_t os_taskIsQueued(os_task_t *t);
+
+  uint8_t os_hasReadyTasks(void);
+  uint8_t os_hasPendingTimers(void);
+  uint8_t os_nextDeadline(uint32_t *deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _OS_TASK_H_
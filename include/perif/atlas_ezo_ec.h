@@ -7,13 +7,126 @@
 
 #include <stdint.h>
 
+/// @brief Conductivity value reported when the reading is missing, cannot be
+/// parsed or does not fit
+#define ATLAS_EZO_EC_INVALID 0xFFFFFFFFUL
+
+// Timeouts in milliseconds
+#define ATLAS_EZO_EC_BOOT_TIMEOUT 2000 // Power on until *RE
+#define ATLAS_EZO_EC_CMD_TIMEOUT 1000  // Command until its response code
+#define ATLAS_EZO_EC_READ_TIMEOUT 1500 // R/RT until the reading
+#define ATLAS_EZO_EC_WAKE_TIMEOUT 200  // Wake character until *WA
+
+/// @brief Baud rate the driver negotiates with the circuit (Baud,n)
+/// @details One of 9600, 19200, 38400, 57600 or 115200 (at most
+/// UART_MAX_BAUD). Faster rates leave less time to serve the receive interrupt
+/// while other code has interrupts disabled.
+#ifndef ATLAS_EZO_EC_BAUD
+#define ATLAS_EZO_EC_BAUD 38400
+#endif
+
+// Estimated supply current of the circuit and its isolator in uA, used to
+// compare the power policies; replace with bench measurements of the board
+#ifndef ATLAS_EZO_EC_ACTIVE_CURRENT
+#define ATLAS_EZO_EC_ACTIVE_CURRENT 20000
+#endif
+#ifndef ATLAS_EZO_EC_SLEEP_CURRENT
+#define ATLAS_EZO_EC_SLEEP_CURRENT 1000 // Includes the 3V3 rail kept on
+#endif
+
+/// @brief Number of samples the automatic policy takes of each policy before
+/// it compares them
+#define ATLAS_EZO_EC_POWER_MIN_SAMPLES 3
+
+/// @brief State of the driver
+typedef enum atlas_ezo_ec_state {
+    atlas_ezo_ec_off,     // Not powered
+    atlas_ezo_ec_sleeping,// Powered, in its Sleep state
+    atlas_ezo_ec_booting, // Powered, waiting for *RE (or *WA after a wake)
+    atlas_ezo_ec_idle,    // Ready for a command
+    atlas_ezo_ec_command, // Command sent, waiting for its response code
+    atlas_ezo_ec_reading, // R/RT sent, waiting for the reading and *OK
+} atlas_ezo_ec_state_t;
+
+/// @brief Outcome of the last boot, command or reading
+typedef enum atlas_ezo_ec_response {
+    atlas_ezo_ec_ok = 0,   // *OK (or *RE after a boot)
+    atlas_ezo_ec_error,    // *ER: unknown command or bad argument
+    atlas_ezo_ec_overvolt, // *OV: supply over voltage
+    atlas_ezo_ec_undervolt,// *UV: supply under voltage
+    atlas_ezo_ec_reset,    // *RS: the circuit reset, the command was lost
+    atlas_ezo_ec_woke,     // *WA: the circuit woke up, the command was lost
+    atlas_ezo_ec_timeout,  // No response in time
+    atlas_ezo_ec_busy,     // Not powered, booting or another command pending
+    atlas_ezo_ec_invalid,  // A reading was received but could not be parsed
+} atlas_ezo_ec_response_t;
+
+/// @brief Version of the settings cache layout in EEPROM, bump on changes
+#define ATLAS_EZO_EC_SETTINGS_VERSION 2
+
+// Settings the EZO keeps in its own EEPROM
+#define ATLAS_EZO_EC_DEFAULT_K 100 // K1.0 probe
+#define ATLAS_EZO_EC_DEFAULT_LED 1 // EZO factory default
+
+/// @brief What to do with the circuit between measurements
+typedef enum atlas_ezo_ec_power {
+    atlas_ezo_ec_power_off = 0, // Cut its power, boot it for every sample
+    atlas_ezo_ec_power_sleep,   // Send it to Sleep, wake it with a character
+    atlas_ezo_ec_power_auto,    // Pick the cheaper one for the sample period
+} atlas_ezo_ec_power_t;
+
+/// @brief Measured cost of a power policy, averaged over the last samples
+typedef struct atlas_ezo_ec_power_stats {
+    uint16_t latency; // ms from power on (off) or wake (sleep) until ready
+    uint16_t awake;   // ms from power on or wake until power off or Sleep
+    uint16_t count;   // Number of samples
+} atlas_ezo_ec_power_stats_t;
+
+/// @brief Desired settings of the circuit
+typedef struct atlas_ezo_ec_settings {
+    uint16_t k;  // Probe cell constant * 100 (K1.0 = 100), 10 to 1000
+    uint8_t led; // 1 to keep the status LED on
+} atlas_ezo_ec_settings_t;
+
 void atlas_ezo_ec_init(void);
-int atlas_ezo_ec_requestValue(uint8_t *value);
-int atlas_ezo_ec_disableContinuousReading(void);
-int atlas_ezo_ec_waitForBoot(void);
+int atlas_ezo_ec_parseValue(const char *str, uint32_t *value);
 void atlas_ezo_ec_disable(void);
 void atlas_ezo_ec_enable(void);
-int atlas_ezo_ec_calibrate(void);
-int atlas_ezo_ec_setTemperature(uint8_t t);
+void atlas_ezo_ec_powerUp(void);
+atlas_ezo_ec_power_t atlas_ezo_ec_powerDown(atlas_ezo_ec_power_t policy);
+uint8_t atlas_ezo_ec_isPowered(void);
+
+// Asynchronous interface
+atlas_ezo_ec_state_t atlas_ezo_ec_process(void);
+uint8_t atlas_ezo_ec_isBusy(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_wait(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_response(void);
+uint32_t atlas_ezo_ec_value(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_startCommand(const char *cmd,
+                                                  uint16_t timeout);
+atlas_ezo_ec_response_t atlas_ezo_ec_startReading(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_startCompensatedReading(int16_t t10);
+
+// Blocking interface, built on the asynchronous one
+atlas_ezo_ec_response_t atlas_ezo_ec_requestValue(uint32_t *value);
+atlas_ezo_ec_response_t atlas_ezo_ec_requestCompensatedValue(int16_t t10,
+                                                             uint32_t *value);
+atlas_ezo_ec_response_t atlas_ezo_ec_disableContinuousReading(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_waitForBoot(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_calibrate(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_setTemperature(uint8_t t);
+
+// Settings cache
+void atlas_ezo_ec_getSettings(atlas_ezo_ec_settings_t *settings);
+int atlas_ezo_ec_setSettings(const atlas_ezo_ec_settings_t *settings);
+void atlas_ezo_ec_forgetSettings(void);
+atlas_ezo_ec_response_t atlas_ezo_ec_applySettings(void);
+
+// Power policy
+const atlas_ezo_ec_power_stats_t *
+atlas_ezo_ec_powerStats(atlas_ezo_ec_power_t policy);
+uint32_t atlas_ezo_ec_powerEnergy(atlas_ezo_ec_power_t policy,
+                                  uint32_t period);
+atlas_ezo_ec_power_t atlas_ezo_ec_choosePower(uint32_t period);
 
 #endif //MFM_SENSOR_MODULE_ATLAS_EZO_EC_H
@@ -8,13 +8,59 @@
 #define DS18B20_READ_SCRATCHPAD 0xBE
 #define DS18B20_COPY_SCRATCHPAD 0x48
 
+#define DS18B20_FAMILY_CODE 0x28
+#define DS18B20_SCRATCHPAD_LENGTH 9
+
+/// @brief Number of sensors kept in the device table
+#ifndef DS18B20_MAX_DEVICES
+#define DS18B20_MAX_DEVICES 3
+#endif
+
+/// @brief Number of times a bad scratchpad is read again, without a new
+/// conversion
+#ifndef DS18B20_READ_RETRIES
+#define DS18B20_READ_RETRIES 3
+#endif
+
+/// @brief Temperature register after power on (85 degrees); read after a
+/// conversion it means the sensor reset and never converted
+#define DS18B20_POWER_ON_VALUE 0x0550
+
+/// @brief Temperature returned when the sensor did not answer (100.00 degrees)
+#define DS18B20_ERROR_VALUE 10000
+
 #define DS18B20_RES_12 3
 #define DS18B20_RES_11 2
 #define DS18B20_RES_10 1
 #define DS18B20_RES_9 0
 
+// Completion polling, in milliseconds
+#define DS18B20_POLL_INTERVAL 10 // Between two polls of a running conversion
+#define DS18B20_POLL_TIMEOUT 1000 // Past the maximum conversion time
+#define DS18B20_COPY_TIME 10 // Storing the scratchpad in the sensor EEPROM
+
+typedef enum ds18b20_state {
+  ds18b20_idle,       // No conversion started
+  ds18b20_converting, // Conversion running in the sensor
+  ds18b20_ready,      // Conversion done, the result can be fetched
+  ds18b20_error,      // No sensor, or the conversion did not finish
+} ds18b20_state_t;
+
+/// @brief Why the last ds18b20_fetch returned DS18B20_ERROR_VALUE
+typedef enum ds18b20_error {
+  ds18b20_err_none,
+  ds18b20_err_absent,   // No sensor answered, or the conversion failed
+  ds18b20_err_crc,      // Every read of the scratchpad was corrupted
+  ds18b20_err_power_on, // The sensor reset and did not convert
+} ds18b20_error_t;
+
 typedef struct ds18b20_t {
    uint8_t resolution; 
+   uint8_t configured;     // The sensor has `resolution` stored in its EEPROM
+   uint8_t state;          // ds18b20_state_t
+   uint8_t error;          // ds18b20_error_t of the last fetch
+   uint32_t convert_start; // millis() at which the last conversion started
+   uint32_t next_poll;     // millis() at which to poll for completion
 } ds18b20_t;
 
 #ifdef __cplusplus
@@ -22,7 +68,13 @@ extern "C"
 {
 #endif
 
-  float ds18b20_read(ds18b20_t* d, uint8_t id);
+  uint8_t ds18b20_scan(void);
+  uint8_t ds18b20_count(void);
+  int16_t ds18b20_read(ds18b20_t* d, uint8_t id);
+  int8_t ds18b20_startConversion(ds18b20_t* d, uint8_t id);
+  ds18b20_state_t ds18b20_poll(ds18b20_t* d);
+  int16_t ds18b20_fetch(ds18b20_t* d, uint8_t id);
+  int16_t ds18b20_readConversion(ds18b20_t* d, uint8_t id);
 
 #ifdef __cplusplus
 }
@@ -7,7 +7,31 @@
 #include <stdint.h>
 #include <avr/io.h>
 
-uint8_t huba713_read(uint16_t *pressure, float *temperature);
+/// @brief Number of frames the median filter is designed for
+#ifndef HUBA_MEDIAN_COUNT
+#define HUBA_MEDIAN_COUNT 11
+#endif
+
+// Adaptive window defaults
+#ifndef HUBA_MIN_SAMPLES
+#define HUBA_MIN_SAMPLES 5 // Valid frames before the spread is checked
+#endif
+#ifndef HUBA_SPREAD
+#define HUBA_SPREAD 4 // Pressure MAD (counts) at which the window is done
+#endif
+
+/// @brief Frames taken for one measurement
+/// @details Sampling stops once at least `min` valid frames have a pressure
+/// median absolute deviation of at most `spread`, or after `max` frames
+typedef struct huba713_window {
+    uint8_t min;     // 3 to max
+    uint8_t max;     // min to HUBA_MEDIAN_COUNT
+    uint16_t spread; // Pressure counts
+} huba713_window_t;
+
+int8_t huba713_read(uint16_t *pressure, int16_t *temperature);
 void huba713_init(void);
+void huba713_median(uint16_t *pressure, int16_t *temperature, uint8_t n);
+uint16_t huba713_mad(const uint16_t *pressure, uint8_t n);
 
 #endif //MFM_SENSOR_MODULE_HUBA713_H
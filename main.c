@@ -10,22 +10,115 @@
 /// Measurements are started by the I2C master by sending a command 0x10 to the
 /// MFM Sensor Module (I2C address 0x36) The measurements will be stored in a
 /// data packet and can be requested by the I2C master by sending a command 0x11
+/// A measurement fills a back buffer that is only published once complete, so
+/// a read never sees a half-updated packet. Reading does not consume the
+/// result: every read returns the last complete measurement.
 /// The data packet will be sent back to the I2C master and is defined as below,
-/// - Number of bytes in the data packet (uint8_t)
+/// - Number of bytes that follow (uint8_t)
+/// - Measurement sequence number (uint16_t, 0 before the first measurement)
+/// - Age of the measurement (uint32_t ms since it was published)
 /// - Huba713 pressure (uint16_t )
-/// - Huba713 temperature (float in degrees Celsius)
-/// - DS18B20 temperature (float in degrees Celsius)
-/// - Atlas Scientific EZO EC conductivity (uint8_t[4]; string holding uS/cm)
+/// - Huba713 temperature (int16_t in centidegrees Celsius)
+/// - DS18B20 temperature (int16_t in centidegrees Celsius)
+/// - Atlas Scientific EZO EC conductivity (uint32_t; uS/cm * 100,
+///   0xFFFFFFFF when the reading failed or did not fit)
+/// - Flags (uint8_t)
+/// - Number of valid Huba713 frames in the median (uint8_t)
+/// - Median absolute deviation of their pressure (uint16_t)
 /// The data will be in little-endian format
 ///
 /// An example of the data packet:
-/// > 0E C1 0B E0 7A A4 41 00 00 AD 41 30 2E 30 30
+/// > 14 07 00 E8 03 00 00 C1 0B 08 08 72 08 F4 27 02 00 00 05 01 00
 ///
-/// - Number of data bytes: 14
+/// - Number of data bytes: 20
+/// - Sequence number: 7
+/// - Age: 1000 ms
 /// - Pressure: 3009
-/// - Temperature: 20.5599975585
-/// - ds18b20_temperature: 21.625
-/// - conductivity: 0.00
+/// - Temperature: 2056 (20.56 degrees)
+/// - ds18b20_temperature: 2162 (21.62 degrees)
+/// - conductivity: 1413.00 uS/cm
+/// - flags: 0x00
+/// - Huba713 frames: 5
+/// - Huba713 pressure MAD: 1
+///
+/// Periodic sampling: writing command 0x20 with a period in seconds (uint16_t)
+/// makes the module measure by itself and store each result with a timestamp
+/// in a RAM history (HISTORY_LENGTH records, oldest dropped when full); a
+/// period of 0 stops it. Reading command 0x20 returns the period. The master
+/// drains the history by writing 0x21 followed by the maximum number of
+/// records N and reading back (a read holds at most DRAIN_MAX_RECORDS):
+/// - Number of bytes that follow (uint8_t)
+/// - Number of records in this response (uint8_t)
+/// - Current time (uint32_t ms since boot)
+/// - Records: timestamp (uint32_t ms since boot) followed by the data packet
+///   without its length byte, sequence number and age
+/// Drained records are removed from the history once they are read.
+///
+/// Status: reading command 0x12 returns
+/// - Number of bytes that follow (uint8_t)
+/// - Status (uint8_t): STATUS_BUSY while a measurement is queued or running,
+///   STATUS_UNREAD when a result was published that 0x11 has not read yet
+/// - Sequence number of the last published measurement (uint16_t)
+/// - Elapsed time (uint32_t ms): since the start of the running measurement,
+///   or the duration of the last one when not busy
+/// - Flags of the last published measurement (uint8_t, FLAG_*)
+/// Writing command 0x13 with a mode selects the data-ready signal on the
+/// SMBALERT line (active low) when a measurement is published:
+/// DATA_READY_OFF, DATA_READY_PULSE (short low pulse) or DATA_READY_ALERT
+/// (held low until 0x11 or 0x12 is read). Reading 0x13 returns the mode.
+///
+/// A response may be read with a repeated start or in a separate transaction
+/// after the command write; it stays available until it is read or another
+/// command is written.
+///
+/// Temperatures: all DS18B20 sensors on the 1-Wire bus convert at once; the
+/// first one found is the one in the data packet. Reading command 0x14 returns
+/// - Number of bytes that follow (uint8_t)
+/// - Number of sensors N (uint8_t, at most DS18B20_MAX_DEVICES)
+/// - N temperatures of the last measurement (int16_t in centidegrees), in
+///   order of their ROM code
+///
+/// Huba frame statistics: reading command 0x15 returns
+/// - Number of bytes that follow (uint8_t)
+/// - Valid frames (uint16_t)
+/// - Frames with a parity error in any byte (uint16_t)
+/// - Timeouts: frames that stopped before their last edge (uint16_t)
+/// - Glitches: pulses too short or too long to be a bit (uint16_t)
+/// - Missing: no idle bus or no frame at all (uint16_t)
+/// The counters run since boot; writing 0x15 with any byte clears them after
+/// they are returned. A missing frame ends the Huba sampling of a measurement,
+/// the other errors only drop the frame.
+///
+/// Huba sampling: a measurement reads Huba713 frames until at least `min`
+/// valid frames agree, i.e. the median absolute deviation of their pressure is
+/// at most `spread` counts, or `max` frames were read. Writing command 0x16
+/// with min (uint8_t, at least 3), max (uint8_t, at most 11) and spread
+/// (uint16_t) sets this; reading 0x16 returns them. A max equal to min reads a
+/// fixed number of frames.
+///
+/// EZO settings: writing command 0x30 with the probe K value * 100 (uint16_t)
+/// and the LED state (uint8_t, 0 or 1) stores the desired settings of the EZO
+/// EC circuit; reading 0x30 returns them. They are sent to the circuit by the
+/// next measurement, and only then: the module remembers what the circuit has
+/// stored and skips commands that would not change anything. Writing command
+/// 0x31 forgets this, e.g. after the circuit was swapped, so every setting is
+/// sent again.
+///
+/// EZO power policy: writing command 0x32 with a policy selects what happens to
+/// the EZO EC circuit between measurements: off (0) cuts its power and boots
+/// it for every sample, sleep (1) sends it to its Sleep state and wakes it
+/// with a character, keeping the 3V3 rail on, and auto (2, default) first
+/// measures both with periodic sampling and then picks the one that costs the
+/// least energy for the sample period. A sleeping circuit is turned off when
+/// the policy is set to off, or when periodic sampling stops under auto.
+/// Reading 0x32 returns
+/// - Number of bytes that follow (uint8_t)
+/// - Selected policy (uint8_t)
+/// - Policy applied after the last measurement (uint8_t)
+/// - For off and then sleep: average boot or wake latency
+///   (uint16_t ms, 0 when not measured) and estimated EZO energy per sample
+///   period (uint32_t uJ), as of the last measurement
+///
 /// When the MFM Sensor Module is not performing measurements, it will be in
 /// sleep mode to save power
 
@@ -36,6 +129,7 @@
 
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <util/atomic.h>
 
@@ -60,33 +154,137 @@ static void pwr_init(void);
 void perform_measurements(void);
 
 #define FLAG_CALIBRATED 0x01
-#define FLAG_HUBA_ERR 0x02
-#define HUBA_MEDIAN_COUNT 11
+#define FLAG_HUBA_ERR 0x02     // One or more Huba frames were invalid
+#define FLAG_HUBA_FAIL 0x04    // No valid Huba frame at all
+#define FLAG_DS18B20_ERR 0x08  // No valid DS18B20 temperature
+#define FLAG_EZO_ERR 0x10      // No valid EZO EC reading
+#define FLAG_DS18B20_CRC 0x20  // With _ERR: scratchpad corrupted on every read
+
+#define STATUS_BUSY 0x01
+#define STATUS_UNREAD 0x02
+
+#define DATA_READY_OFF 0x00
+#define DATA_READY_PULSE 0x01
+#define DATA_READY_ALERT 0x02
 
 // Forward declaration of variables
 /// @brief I2C Data packet
 struct packet_t {
     uint16_t huba_pressure;
-    float huba_temperature;
-    float ds18b20_temperature;
-    uint8_t atlas_conductivity[8];
+    int16_t huba_temperature;
+    int16_t ds18b20_temperature;
+    uint32_t atlas_conductivity;
     uint8_t flags;
-} packet;
+    uint8_t huba_samples; // Valid Huba frames in the median
+    uint16_t huba_mad;    // Pressure median absolute deviation of those
+};
+
+/// @brief Published measurement, laid out as sent by cmd 0x11 up to
+/// `published`
+struct result_t {
+    uint8_t length;     // Number of bytes that follow on the bus
+    uint16_t sequence;  // Incremented for every published measurement
+    uint32_t age;       // Filled in by the 0x11 handler
+    struct packet_t packet;
+    uint32_t published; // millis() at publish, not sent
+};
+
+/// @brief Number of bytes of a result_t sent by cmd 0x11
+#define RESULT_TX_LENGTH offsetof(struct result_t, published)
+
+/// @brief Triple buffer of measurements
+/// @details results[result_front] is the last complete measurement and
+/// results[result_reading] the last one handed to the TWI, which streams it
+/// without a copy. perform_measurements fills the remaining entry, so it never
+/// writes a result that may still be on the bus. The length is fixed, so a
+/// read before the first measurement gets a full packet with sequence 0.
+struct result_t results[3] = {
+    {.length = RESULT_TX_LENGTH - 1},
+    {.length = RESULT_TX_LENGTH - 1},
+    {.length = RESULT_TX_LENGTH - 1},
+};
+volatile uint8_t result_front = 0;
+volatile uint8_t result_reading = 0;
+
+/// @brief Number of records kept by periodic sampling
+#ifndef HISTORY_LENGTH
+#define HISTORY_LENGTH 16
+#endif
+
+/// @brief Timestamped data packet stored by periodic sampling
+struct record_t {
+    uint32_t timestamp;
+    struct packet_t packet;
+};
+
+/// @brief Ring buffer of periodic samples, oldest record at history_tail
+struct record_t history[HISTORY_LENGTH];
+volatile uint8_t history_tail = 0;
+volatile uint8_t history_count = 0;
+
+/// @brief Period of the autonomous sampling in seconds, 0 when disabled
+volatile uint16_t samplePeriod = 0;
 
-// "tasks" that will be performed on wakeup (interrupt)
+// Calibration request, handled by the next measurement
 volatile uint8_t doCalibration = 0;
-volatile uint8_t doMeasurement = 0;
+
+/// @brief Measurement progress, reported by cmd 0x12
+volatile uint8_t measuring = 0;
+volatile uint8_t unread = 0;
+uint32_t measureStart = 0;
+uint32_t measureDuration = 0;
+
+/// @brief Data-ready signal mode, DATA_READY_*
+volatile uint8_t dataReadyMode = DATA_READY_OFF;
+
+/// @brief Desired EZO settings as set by cmd 0x30, stored by the next
+/// measurement since EEPROM writes are too slow for the TWI ISR
+atlas_ezo_ec_settings_t ezoSettings;
+volatile uint8_t ezoSettingsChanged = 0;
+volatile uint8_t ezoSettingsForget = 0;
+
+/// @brief Huba sampling window set by cmd 0x16
+huba713_window_t hubaWindow = {HUBA_MIN_SAMPLES, HUBA_MEDIAN_COUNT,
+                               HUBA_SPREAD};
+
+/// @brief EZO power policy selected by cmd 0x32, atlas_ezo_ec_power_t
+volatile uint8_t ezoPower = atlas_ezo_ec_power_auto;
+/// @brief Power policy report of cmd 0x32, updated after every measurement
+uint8_t ezoPowerReport[15];
+
+static void sample_task(void);
+static void ezo_off_task(void);
+
+/// @brief Task that runs perform_measurements, posted by cmd 0x10
+os_task_t measurementTask = OS_TASK_INIT(perform_measurements);
+/// @brief Task that measures and stores a record every samplePeriod seconds
+os_task_t sampleTask = OS_TASK_INIT(sample_task);
+/// @brief Task that turns a sleeping EZO off, posted by cmd 0x20 and 0x32
+os_task_t ezoOffTask = OS_TASK_INIT(ezo_off_task);
+
+/// @brief Temperatures of all DS18B20 sensors of the last measurement
+int16_t ds18b20_temperatures[DS18B20_MAX_DEVICES];
+uint8_t ds18b20_sensors = 0;
+
+#if 2 + DS18B20_MAX_DEVICES * 2 > TWI_BUFFER_LENGTH
+#error "The cmd 0x14 response does not fit in the TWI buffer"
+#endif
 
 /// @brief DS18B20 struct to hold resolution, defined here so we can set it once
-/// in main
+/// in main; the sensor stores it on the first conversion
 ds18b20_t d;
 
 /// @brief Initialize the power control
-/// @details 5V and 3V3 will be disabled after initialization
+/// @details 5V and 3V3 will be disabled after initialization, the data-ready
+/// line is released
 void pwr_init(void) {
     ENABLE_5V_PORT.DIRSET = ENABLE_5V_PIN;   // 5V_on as output
     ENABLE_3V3_PORT.DIRSET = ENABLE_3V3_PIN; // 3V3_on as output
 
+    // Data-ready (SMBALERT) is active low, idle high
+    DATA_READY_PORT.OUTSET = DATA_READY_PIN;
+    DATA_READY_PORT.DIRSET = DATA_READY_PIN;
+
     pwr_3v3Enable(PWR_DISABLE);
     pwr_5vEnable(PWR_DISABLE);
 }
@@ -111,141 +309,473 @@ void pwr_3v3Enable(uint8_t enable) {
     }
 }
 
-/* Function to sort an array using insertion sort*/
-void insertion_sort_u16(uint16_t arr[], int n) {
-    int i, key, j;
-    for (i = 1; i < n; i++) {
-        key = arr[i];
-        j = i - 1;
-
-        /* Move elements of arr[0..i-1], that are
-        greater than key, to one position ahead
-        of their current position */
-        while (j >= 1 && arr[j] > key) {
-            arr[j + 1] = arr[j];
-            j = j - 1;
-        }
-        arr[j + 1] = key;
+/// @brief Release the data-ready line (high)
+static void data_ready_release(void) {
+    DATA_READY_PORT.OUTSET = DATA_READY_PIN;
+}
+
+/// @brief Signal the master that a measurement was published
+static void data_ready_signal(void) {
+    if (dataReadyMode == DATA_READY_OFF) {
+        return;
+    }
+    DATA_READY_PORT.OUTCLR = DATA_READY_PIN;
+    if (dataReadyMode == DATA_READY_PULSE) {
+        delay_us(100);
+        data_ready_release();
     }
 }
 
-/* Function to sort an array using insertion sort*/
-void insertion_sort_f(float arr[], int n) {
-    int i, key, j;
-    for (i = 1; i < n; i++) {
-        key = arr[i];
-        j = i - 1;
-
-        /* Move elements of arr[0..i-1], that are
-        greater than key, to one position ahead
-        of their current position */
-        while (j >= 1 && arr[j] > key) {
-            arr[j + 1] = arr[j];
-            j = j - 1;
-        }
-        arr[j + 1] = key;
+/// @brief Update the report of cmd 0x32
+/// @param applied Policy applied after the measurement
+/// @param period Sample period in ms the energy is estimated for
+static void ezo_power_report(atlas_ezo_ec_power_t applied, uint32_t period) {
+    uint8_t report[sizeof(ezoPowerReport)];
+    uint8_t *p = &report[3];
+
+    report[0] = sizeof(report) - 1;
+    report[2] = applied;
+    for (uint8_t policy = atlas_ezo_ec_power_off;
+         policy <= atlas_ezo_ec_power_sleep; policy++) {
+        uint16_t latency = atlas_ezo_ec_powerStats(policy)->latency;
+        uint32_t energy = atlas_ezo_ec_powerEnergy(policy, period);
+        memcpy(p, &latency, 2);
+        memcpy(p + 2, &energy, 4);
+        p += 6;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        report[1] = ezoPower;
+        memcpy(ezoPowerReport, report, sizeof(report));
     }
 }
 
-/// @brief Perform measurements from different sensors and store them in global
-/// variables
-/// @details This function is called from the twi_perform_task, which is called
-/// from the I2C ISR it will enable 5V and 3V3, initialize sensors, perform the
-/// measurements and disable 5V and 3V3
+/// @brief Perform measurements from different sensors and publish them in
+/// `results`
+/// @details This function runs as measurementTask, which is posted from the I2C
+/// ISR. The sensor latencies are overlapped instead of waited for one after
+/// another:
+/// - the DS18B20 conversion is started first and runs in the sensor,
+/// - the EZO EC circuit is powered (or woken) and boots during the conversion,
+/// - the Huba is sampled right after, while the EZO boots; the conversion
+///   may still be running or already done, depending on the resolution.
+/// The Huba frames are captured in the background with interrupts enabled, so
+/// the UART receive interrupt keeps the *RE banner of the EZO meanwhile.
+/// The values are written to the back buffer, which is published with a single
+/// index write once the measurement is complete.
 void perform_measurements() {
-    // Conductivity data (string holding uS/cm)
-    static uint8_t conductivity[8] = {0};
-    static float ds18b20_temperature;
+    uint8_t index_back = 0;
+    while (index_back == result_front || index_back == result_reading) {
+        index_back++;
+    }
+    struct result_t *back = &results[index_back];
+    struct packet_t *packet = &back->packet;
+    // Conductivity data (uS/cm * 100)
+    static uint32_t conductivity = ATLAS_EZO_EC_INVALID;
+    static int16_t ds18b20_temperature;
     static uint16_t huba_pressure = 0;
-    static float huba_temperature = 0.0;
+    static int16_t huba_temperature = 0;
 
     uint16_t median_pressure[HUBA_MEDIAN_COUNT] = {0};
-    float median_temperature[HUBA_MEDIAN_COUNT] = {0};
+    int16_t median_temperature[HUBA_MEDIAN_COUNT] = {0};
+
+    memset(packet, 0, sizeof(struct packet_t));
+    measureStart = millis();
+    measuring = 1;
+
+    // The power policy for this sample decides what happens to the EZO EC
+    // afterwards; on-demand measurements have no period
+    atlas_ezo_ec_power_t power = ezoPower;
+    uint32_t period = (uint32_t)samplePeriod * 1000;
+    if (power == atlas_ezo_ec_power_auto) {
+        power = atlas_ezo_ec_choosePower(period);
+    }
 
-    // Enable 5V and 3V3
+    // Enable 3V3 for the DS18B20 and EZO EC, it stays on while the EZO sleeps
+    if (!atlas_ezo_ec_isPowered()) {
+        pwr_3v3Enable(PWR_ENABLE);
+        delay_ms(10);
+    }
+
+    // Start the DS18B20 conversion (one-wire), read back after the Huba
+    ds18b20_startConversion(&d, 0);
+
+    // Wake the Atlas Scientific EZO EC, or turn it on by setting the enable
+    // pin; it boots while the DS18B20 converts and the Huba is sampled
+    atlas_ezo_ec_powerUp();
+
+    // The HUBA sensor is the only sensor in need of 5V, so enable it just for
+    // the reading
     pwr_5vEnable(PWR_ENABLE);
-    pwr_3v3Enable(PWR_ENABLE);
-    delay_ms(10);
+    // Busy wait: STANDBY would stop TCB0, which measures the bus idle time
+    // the first frame is synchronised on
+    delay_us(10000);
 
-    // Measure huba sensor using median filter
+    // Measure huba sensor using median filter, until the frames agree
+    huba713_window_t window;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { window = hubaWindow; }
     int errs = 0;
     int index = 0;
-    for (uint8_t tries = 0; tries < HUBA_MEDIAN_COUNT; tries++) {
+    for (uint8_t tries = 0; tries < window.max; tries++) {
         // read value from Huba sensor (zacwire)
-        int err = huba713_read(&huba_pressure, &huba_temperature);
+        int8_t err = huba713_read(&huba_pressure, &huba_temperature);
+        // Take in the EZO boot banner as it arrives, so its latency is right
+        atlas_ezo_ec_process();
         if (err == 0) {
             median_pressure[index] = huba_pressure;
             median_temperature[index++] = huba_temperature;
+            if (index >= window.min &&
+                huba713_mad(median_pressure, index) <= window.spread) {
+                break;
+            }
         } else {
             errs++;
+            // No frame at all: the sensor is missing or dead, the next tries
+            // would only wait out the same timeout
+            if (err == ZACWIRE_ERR_NO_FRAME) {
+                break;
+            }
         }
     }
 
-    // The HUBA sensor is the only sensor in need of 5V, so disable it after
-    // reading
     pwr_5vEnable(PWR_DISABLE);
 
+    // Collect the *RE (or *WA) the EZO sent while the Huba was sampled; a
+    // dead probe costs what is left of one boot timeout
+    uint8_t ezo_ok = atlas_ezo_ec_waitForBoot() == atlas_ezo_ec_ok;
+
+    // Store settings changed over TWI, then only send the ones the circuit
+    // does not have yet (continuous reading off, EC output only, K, LED)
+    if (ezoSettingsForget) {
+        ezoSettingsForget = 0;
+        atlas_ezo_ec_forgetSettings();
+    }
+    if (ezoSettingsChanged) {
+        atlas_ezo_ec_settings_t settings;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            settings = ezoSettings;
+            ezoSettingsChanged = 0;
+        }
+        atlas_ezo_ec_setSettings(&settings);
+    }
+    if (ezo_ok) {
+        atlas_ezo_ec_applySettings();
+    }
+
     // Prepare HUBA Sensor values
     if (errs > 0) {
-        packet.flags |= FLAG_HUBA_ERR;
+        packet->flags |= FLAG_HUBA_ERR;
     }
     // Make sure there is atleast one valid measurements to perform median
     if (index > 0) {
-        insertion_sort_u16(median_pressure, index);
-        insertion_sort_f(median_temperature, index);
+        packet->huba_samples = index;
+        packet->huba_mad = huba713_mad(median_pressure, index);
+        huba713_median(median_pressure, median_temperature, index);
         huba_pressure = median_pressure[index / 2];
         huba_temperature = median_temperature[index / 2];
     } else {
         // Otherwise error
+        packet->flags |= FLAG_HUBA_FAIL;
         huba_pressure = 0;
-        huba_temperature = 200.0f;
+        huba_temperature = 20000;
     }
-    delay_us(1000);
-
-    // read value from DS18B20 sensor (one-wire)
-    ds18b20_read(&d, 0);
-    ds18b20_temperature = ds18b20_read(&d, 0);
 
-    // Turn the Atlas Scientific EZO EC sensor on by setting the enable pin
-    atlas_ezo_ec_enable();
+    // Collect the DS18B20 result, polls until the sensor reports it is done
+    ds18b20_temperature = ds18b20_readConversion(&d, 0);
+    if (ds18b20_temperature == DS18B20_ERROR_VALUE) {
+        packet->flags |= FLAG_DS18B20_ERR;
+        if (d.error == ds18b20_err_crc) {
+            packet->flags |= FLAG_DS18B20_CRC;
+        }
+    }
+    // The other sensors converted at the same time, only read them
+    {
+        int16_t temperatures[DS18B20_MAX_DEVICES];
+        uint8_t sensors = ds18b20_count();
+        temperatures[0] = ds18b20_temperature;
+        for (uint8_t id = 1; id < sensors; id++) {
+            temperatures[id] = ds18b20_fetch(&d, id);
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            memcpy(ds18b20_temperatures, temperatures, sizeof(temperatures));
+            ds18b20_sensors = sensors;
+        }
+    }
 
-    // We only want to read the value once, so disable continuous reading
-    atlas_ezo_ec_disableContinuousReading();
+    if (ezo_ok) {
+        if (doCalibration) {
+            if (atlas_ezo_ec_calibrate() == atlas_ezo_ec_ok) {
+                packet->flags |= FLAG_CALIBRATED;
+            }
+            doCalibration = 0;
+        }
 
-    // Set temperature compensation
-    if (ds18b20_temperature > -50 && ds18b20_temperature < 50) {
-        atlas_ezo_ec_setTemperature((uint8_t)ds18b20_temperature);
+        // Read value from Atlas Scientific EZO EC sensor (UART) with
+        // temperature compensation in a single round trip
+        int16_t compensation = 100;
+        if (ds18b20_temperature > -5000 && ds18b20_temperature < 5000) {
+            compensation = ds18b20_temperature / 10;
+        }
+        if (atlas_ezo_ec_requestCompensatedValue(compensation, &conductivity) !=
+            atlas_ezo_ec_ok) {
+            packet->flags |= FLAG_EZO_ERR;
+        }
     } else {
-        atlas_ezo_ec_setTemperature(10);
+        conductivity = ATLAS_EZO_EC_INVALID;
+        packet->flags |= FLAG_EZO_ERR;
     }
 
-    if (doCalibration) {
-        atlas_ezo_ec_calibrate();
-        packet.flags |= FLAG_CALIBRATED;
-        doCalibration = 0;
-    }
-
-    // read value from Atlas Scientific EZO EC sensor (UART)
-    atlas_ezo_ec_requestValue(conductivity);
-
     // Small delay before turning off the sensor
     delay_us(200);
-    // Turn the Atlas Scientific EZO EC sensor off by clearing the enable pin
-    atlas_ezo_ec_disable();
+    // Send the Atlas Scientific EZO EC sensor to sleep, or turn it off by
+    // clearing the enable pin
+    power = atlas_ezo_ec_powerDown(power);
 
     // Small delay to give the CPU time to read the last data from the UART
     delay_us(500);
 
-    // All done, so disable 3V3
-    pwr_3v3Enable(PWR_DISABLE);
+    // All done, so disable 3V3 unless the EZO sleeps on it
+    if (!atlas_ezo_ec_isPowered()) {
+        pwr_3v3Enable(PWR_DISABLE);
+    }
+    ezo_power_report(power, period);
 
     // Store the data in data struct
-    packet.huba_pressure = huba_pressure;
-    packet.huba_temperature = huba_temperature;
-    packet.ds18b20_temperature = ds18b20_temperature;
-    for (int ii = 0; ii < 8; ii++) {
-        packet.atlas_conductivity[ii] = conductivity[ii];
+    packet->huba_pressure = huba_pressure;
+    packet->huba_temperature = huba_temperature;
+    packet->ds18b20_temperature = ds18b20_temperature;
+    packet->atlas_conductivity = conductivity;
+
+    // Publish; a single byte write is atomic with respect to the TWI ISR
+    back->sequence = results[result_front].sequence + 1;
+    back->published = millis();
+    result_front = index_back;
+
+    measureDuration = millis() - measureStart;
+    measuring = 0;
+    unread = 1;
+    data_ready_signal();
+}
+
+/// @brief Store the last published data packet in the history
+/// @details Overwrites the oldest record when the history is full
+/// @param timestamp millis() at the start of the measurement
+static void history_push(uint32_t timestamp) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t head = (history_tail + history_count) % HISTORY_LENGTH;
+        history[head].timestamp = timestamp;
+        memcpy(&history[head].packet, &results[result_front].packet,
+               sizeof(struct packet_t));
+        if (history_count < HISTORY_LENGTH) {
+            history_count++;
+        } else {
+            history_tail = (history_tail + 1) % HISTORY_LENGTH;
+        }
+    }
+}
+
+/// @brief Periodic sampling task
+/// @details Re-posts itself relative to its previous deadline, so the period
+/// does not drift by the measurement time. When a measurement took longer
+/// than the period the next one is scheduled a full period from now.
+static void sample_task(void) {
+    uint32_t start = millis();
+    uint32_t deadline = sampleTask.deadline;
+
+    perform_measurements();
+    history_push(start);
+
+    if (samplePeriod) {
+        uint32_t period = (uint32_t)samplePeriod * 1000;
+        uint32_t now = millis();
+        deadline += period;
+        if ((int32_t)(deadline - now) < 0) {
+            deadline = now + period;
+        }
+        os_taskPostAt(&sampleTask, deadline);
+    }
+}
+
+/// @brief Turn the EZO EC off when the power policy no longer wants it asleep
+/// @details Only the next measurement would otherwise cut the 3V3 rail, and
+/// there may never be one. An explicit sleep policy keeps it asleep until the
+/// next on-demand measurement.
+static void ezo_off_task(void) {
+    atlas_ezo_ec_power_t power = ezoPower;
+
+    if (!atlas_ezo_ec_isPowered() || power == atlas_ezo_ec_power_sleep ||
+        (power == atlas_ezo_ec_power_auto && samplePeriod)) {
+        return;
+    }
+    atlas_ezo_ec_powerDown(atlas_ezo_ec_power_off);
+    pwr_3v3Enable(PWR_DISABLE);
+    ezo_power_report(atlas_ezo_ec_power_off, (uint32_t)samplePeriod * 1000);
+}
+
+/// @brief Handler for cmd 0x14 from I2C master
+/// @details Copies the temperatures of all DS18B20 sensors to the bus
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_14_handler(uint8_t *buf, uint8_t len) {
+    uint8_t size = ds18b20_sensors * sizeof(int16_t);
+
+    buf[0] = size + 1;
+    buf[1] = ds18b20_sensors;
+    memcpy(&buf[2], ds18b20_temperatures, size);
+}
+
+/// @brief Handler for cmd 0x15 from I2C master
+/// @details Copies the Huba (ZACwire) frame statistics to the bus, and clears
+/// them when written with a byte
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_15_handler(uint8_t *buf, uint8_t len) {
+    zacwire_stats_t stats;
+
+    zacwire_getStats(&stats);
+    if (len >= 2) {
+        zacwire_clearStats();
+    }
+    buf[0] = sizeof(stats);
+    memcpy(&buf[1], (uint8_t *)&stats, sizeof(stats));
+}
+
+/// @brief Handler for cmd 0x16 from I2C master
+/// @details Sets the Huba sampling window when written with min (uint8_t), max
+/// (uint8_t) and spread (uint16_t), returns it when read
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_16_handler(uint8_t *buf, uint8_t len) {
+    if (len >= 5 && buf[1] >= 3 && buf[1] <= buf[2] &&
+        buf[2] <= HUBA_MEDIAN_COUNT) {
+        hubaWindow.min = buf[1];
+        hubaWindow.max = buf[2];
+        hubaWindow.spread = buf[3] | ((uint16_t)buf[4] << 8);
+    }
+    buf[0] = sizeof(hubaWindow);
+    memcpy(&buf[1], &hubaWindow, sizeof(hubaWindow));
+}
+
+/// @brief Handler for cmd 0x20 from I2C master
+/// @details Sets the period of the autonomous sampling when written with a
+/// uint16_t (seconds, 0 disables), returns the current period when read
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_20_handler(uint8_t *buf, uint8_t len) {
+    if (len >= 3) {
+        samplePeriod = buf[1] | ((uint16_t)buf[2] << 8);
+        if (samplePeriod) {
+            os_taskPostAt(&sampleTask, millis());
+        } else {
+            os_taskCancel(&sampleTask);
+            os_taskPost(&ezoOffTask);
+        }
+    }
+    buf[0] = sizeof(samplePeriod);
+    memcpy(&buf[1], (uint8_t *)&samplePeriod, sizeof(samplePeriod));
+}
+
+/// @brief Maximum number of records in one drain, so the length byte fits
+#define DRAIN_MAX_RECORDS ((0xFF - 5) / sizeof(struct record_t))
+
+// Response of cmd 0x21: length, record count and current time
+static uint8_t drain_header[6];
+static uint8_t drain_pos;
+// History entry being sent, its copy and the next byte of it
+static uint8_t drain_index;
+static struct record_t drain_record;
+static uint8_t drain_offset;
+
+/// @brief Produces the cmd 0x21 response from the history
+/// @details Each record is copied when its first byte is sent, so a record
+/// history_push overwrites meanwhile is still sent whole. A record is removed
+/// from the history once its last byte is on the bus, so a read the master
+/// aborts early leaves the unsent records in place.
+static uint8_t twi_cmd_21_producer(void) {
+    if (drain_pos < sizeof(drain_header)) {
+        return drain_header[drain_pos++];
+    }
+
+    // history_push runs atomically, so this ISR never copies half of one
+    if (drain_offset == 0) {
+        drain_record = history[drain_index];
+    }
+    uint8_t b = ((uint8_t *)&drain_record)[drain_offset++];
+    if (drain_offset == sizeof(struct record_t)) {
+        // Skip the removal when history_push already overwrote the record
+        if (history_tail == drain_index && history_count) {
+            history_tail = (history_tail + 1) % HISTORY_LENGTH;
+            history_count--;
+        }
+        drain_index = (drain_index + 1) % HISTORY_LENGTH;
+        drain_offset = 0;
     }
+    return b;
+}
+
+/// @brief Handler for cmd 0x21 from I2C master
+/// @details Streams up to N (second written byte) of the oldest records from
+/// the history to the bus, at most DRAIN_MAX_RECORDS
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_21_handler(uint8_t *buf, uint8_t len) {
+    uint8_t count = (len >= 2) ? buf[1] : 1;
+    uint32_t now = millis();
+
+    if (count > history_count) {
+        count = history_count;
+    }
+    if (count > DRAIN_MAX_RECORDS) {
+        count = DRAIN_MAX_RECORDS;
+    }
+
+    drain_header[0] =
+        sizeof(drain_header) - 1 + count * sizeof(struct record_t);
+    drain_header[1] = count;
+    memcpy(&drain_header[2], &now, sizeof(now));
+    drain_pos = 0;
+    drain_index = history_tail;
+    drain_offset = 0;
+
+    twi_transmitWith(&twi_cmd_21_producer, drain_header[0] + 1);
+}
+
+/// @brief Handler for cmd 0x30 from I2C master
+/// @details Sets the desired EZO settings when written with the K value * 100
+/// (uint16_t) and the LED state (uint8_t), returns them when read
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_30_handler(uint8_t *buf, uint8_t len) {
+    if (len >= 4) {
+        uint16_t k = buf[1] | ((uint16_t)buf[2] << 8);
+        if (k >= 10 && k <= 1000 && buf[3] <= 1) {
+            ezoSettings.k = k;
+            ezoSettings.led = buf[3];
+            ezoSettingsChanged = 1;
+        }
+    }
+    buf[0] = 3;
+    memcpy(&buf[1], &ezoSettings.k, 2);
+    buf[3] = ezoSettings.led;
+}
+
+/// @brief Handler for cmd 0x31 from I2C master
+/// @details Makes the next measurement send all EZO settings again
+/// @param buf Pointer to the buffer to store the data in, not used
+/// @param len Length of the buffer, not used
+void twi_cmd_31_handler(uint8_t *buf, uint8_t len) { ezoSettingsForget = 1; }
+
+/// @brief Handler for cmd 0x32 from I2C master
+/// @details Selects the EZO power policy when written, returns the policy
+/// report when read
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_32_handler(uint8_t *buf, uint8_t len) {
+    if (len >= 2 && buf[1] <= atlas_ezo_ec_power_auto) {
+        ezoPower = buf[1];
+        ezoPowerReport[1] = ezoPower;
+        os_taskPost(&ezoOffTask);
+    }
+    memcpy(buf, ezoPowerReport, sizeof(ezoPowerReport));
 }
 
 /// @brief Handler for cmd 0x80 from I2C master
@@ -254,29 +784,94 @@ void perform_measurements() {
 /// @param len Length of the buffer
 void twi_cmd_80_handler(uint8_t *buf, uint8_t len) { doCalibration = 1; }
 
+/// @brief Marks the streamed measurement as read, called from the TWI ISR
+static void twi_cmd_11_transmitted(void) {
+    unread = 0;
+    data_ready_release();
+}
+
 /// @brief Handler for cmd 0x11 from I2C master
-/// @details Copies the sensor data from the data packet to the bus; kept short
-/// as possible!
+/// @details Streams the last published measurement to the bus without copying
+/// it; it is only marked read once the master reads it; kept short as possible!
+/// @param buf Pointer to the buffer to store the data in, not used
+/// @param len Length of the buffer, not used
+void twi_cmd_11_handler(uint8_t *buf, uint8_t len) {
+    struct result_t *front = &results[result_front];
+
+    result_reading = result_front;
+    front->age = millis() - front->published;
+    twi_transmit(front, RESULT_TX_LENGTH);
+    twi_onTransmitted(&twi_cmd_11_transmitted);
+}
+
+/// @brief Handler for cmd 0x12 from I2C master
+/// @details Copies the measurement status to the bus
 /// @param buf Pointer to the buffer to store the data in
 /// @param len Length of the buffer
-void twi_cmd_11_handler(uint8_t *buf, uint8_t len) {
-    buf[0] = sizeof(struct packet_t);
-    memcpy(&buf[1], &packet, buf[0]);
-    memset(&packet, 0, sizeof(struct packet_t));
+void twi_cmd_12_handler(uint8_t *buf, uint8_t len) {
+    uint8_t status = 0;
+    uint32_t elapsed = measureDuration;
+
+    if (measuring) {
+        status |= STATUS_BUSY;
+        elapsed = millis() - measureStart;
+    } else if (os_taskIsQueued(&measurementTask)) {
+        status |= STATUS_BUSY;
+        elapsed = 0;
+    }
+    if (unread) {
+        status |= STATUS_UNREAD;
+    }
+
+    buf[0] = 8;
+    buf[1] = status;
+    memcpy(&buf[2], (uint8_t *)&results[result_front].sequence, 2);
+    memcpy(&buf[4], &elapsed, 4);
+    buf[8] = results[result_front].packet.flags;
+
+    twi_onTransmitted(&data_ready_release);
+}
+
+/// @brief Handler for cmd 0x13 from I2C master
+/// @details Sets the data-ready signal mode when written, returns it when read
+/// @param buf Pointer to the buffer to store the data in
+/// @param len Length of the buffer
+void twi_cmd_13_handler(uint8_t *buf, uint8_t len) {
+    if (len >= 2 && buf[1] <= DATA_READY_ALERT) {
+        dataReadyMode = buf[1];
+        if (dataReadyMode == DATA_READY_OFF) {
+            data_ready_release();
+        }
+    }
+    buf[0] = 1;
+    buf[1] = dataReadyMode;
 }
 
 /// @brief Handler for cmd 0x10 from I2C master
-/// @details Creates a task to start measurements; kept short as possible!
+/// @details Posts the measurement task; kept short as possible!
 /// @param buf Pointer to the buffer to store the data in, not used
 /// @param len Length of the buffer, not used
-void twi_cmd_10_handler(uint8_t *buf, uint8_t len) { doMeasurement = 0x01; }
+void twi_cmd_10_handler(uint8_t *buf, uint8_t len) {
+    os_taskPost(&measurementTask);
+}
 
 /// @brief Accapted TWI (I2C) commands
-twi_cmd_t twi_cmds[] = {
-    {0x10, &twi_cmd_10_handler},
-    {0x11, &twi_cmd_11_handler},
-    {0x80, &twi_cmd_80_handler},
-};
+#define TWI_COMMANDS(X)                                                        \
+    X(0x10, twi_cmd_10_handler)                                                \
+    X(0x11, twi_cmd_11_handler)                                                \
+    X(0x12, twi_cmd_12_handler)                                                \
+    X(0x13, twi_cmd_13_handler)                                                \
+    X(0x14, twi_cmd_14_handler)                                                \
+    X(0x15, twi_cmd_15_handler)                                                \
+    X(0x16, twi_cmd_16_handler)                                                \
+    X(0x20, twi_cmd_20_handler)                                                \
+    X(0x21, twi_cmd_21_handler)                                                \
+    X(0x30, twi_cmd_30_handler)                                                \
+    X(0x31, twi_cmd_31_handler)                                                \
+    X(0x32, twi_cmd_32_handler)                                                \
+    X(0x80, twi_cmd_80_handler)
+
+TWI_DEFINE_COMMANDS(TWI_COMMANDS)
 
 /// @brief Waits for the watchdog to sync
 /// @details
@@ -301,8 +896,6 @@ void os_postsleep(void) {
 
 /// @brief main function
 int main() {
-    doMeasurement = 0;
-
     os_init();
 
     // Initialize the delay system
@@ -315,8 +908,10 @@ int main() {
     // Set resolution of DS18B20 temperature sensor
     d.resolution = DS18B20_RES_12;
 
-    // Initialize EZO EC
+    // Initialize EZO EC, loads its settings cache from EEPROM
     atlas_ezo_ec_init();
+    atlas_ezo_ec_getSettings(&ezoSettings);
+    ezo_power_report(atlas_ezo_ec_power_off, 0);
 
     // Initialize the HUBA sensor
     huba713_init();
@@ -336,16 +931,15 @@ int main() {
 
     // Main loop
     while (1) {
-        // Check if we need to perform measurements
-        if (doMeasurement == 0x01) {
-            doMeasurement = 0x00;
-            perform_measurements();
-        }
+        // Run the next ready task, os_sleep returns at once while more are
+        // ready
+        os_processTasks();
 
         // Kick the watchdog
         wdt_reset();
 
-        // Sleep the system, note: watchdog will be disabled during sleep
+        // Sleep until the next interrupt or task deadline, note: watchdog will
+        // be disabled during sleep
         os_sleep();
     }
 }
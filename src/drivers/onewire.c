@@ -1,84 +1,174 @@
 #include "../../include/drivers/onewire.h"
 
 #include <avr/io.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 
-#define _high_cycles 4
-#define _sample_cycles 4
-#define _low_cycles 7
+/// @brief CPU cycles for `ns` nanoseconds at F_CPU, rounded up
+/// @details Integer math only, so it folds to the exact constant that
+/// __builtin_avr_delay_cycles needs at any F_CPU
+#define OW_CYCLES(ns) (((F_CPU / 1000ULL) * (ns) + 999999ULL) / 1000000ULL)
 
-// We need the 1.75 factor as the delay will be to short otherwise
-#define usToCycles(us) ceil(fabs(((F_CPU / 1000000) * us * 1.1)))
-//#define usToCycles(us) ceil(fabs(((3333333 / 1000000) * us * 1.1)))
-//#define usToCycles(us) ((unsigned long)(ceil(fabs(((F_CPU / 1000000) * us )))))
+/// @brief Cycles taken by the pin access that ends a delay (single cycle
+/// sbi/cbi/in on the virtual port)
+#define OW_PIN_CYCLES 1
+
+/// @brief Delay for timing `t` of the standard (od == 0) or overdrive speed,
+/// minus the pin access that follows it
+#define OW_DELAY(od, t)                                                        \
+  do                                                                           \
+  {                                                                            \
+    if (od)                                                                    \
+      __builtin_avr_delay_cycles(OW_WAIT(OW_OD_TIME_##t));                     \
+    else                                                                       \
+      __builtin_avr_delay_cycles(OW_WAIT(OW_TIME_##t));                        \
+  } while (0)
+#define OW_WAIT(ns)                                                            \
+  (OW_CYCLES(ns) > OW_PIN_CYCLES ? OW_CYCLES(ns) - OW_PIN_CYCLES : 0)
 
-//#define usToCycles(us) ceil(fabs(((F_CPU / 1000000) * us)))
 extern void __builtin_avr_delay_cycles(unsigned long);
 
-void _low()
+#define OW_INLINE static inline __attribute__((always_inline))
+
+/// @brief Current bus speed, OW_SPEED_*
+static uint8_t ow_speed = OW_SPEED_STANDARD;
+
+OW_INLINE void _low(void)
 {
   // Set out low
-  OW_PORT.DIRSET = 1 << OW_PIN;
-  OW_PORT.OUTCLR = 1 << OW_PIN;
+  OW_VPORT.OUT &= ~(1 << OW_PIN);
+  OW_VPORT.DIR |= 1 << OW_PIN;
 }
 
-void _high()
+OW_INLINE void _high(void)
 {
   // Set input (preferably floating)
-  OW_PORT.DIRCLR = 1 << OW_PIN;
+  OW_VPORT.DIR &= ~(1 << OW_PIN);
 }
 
-uint8_t _sample()
+OW_INLINE uint8_t _sample(void)
 {
-  return (OW_PORT.IN & (1 << OW_PIN)) > 0;
+  return (OW_VPORT.IN & (1 << OW_PIN)) != 0;
 }
 
-uint8_t ow_reset()
+// The slots below are only inlined with a constant `od`, so each speed gets
+// its own straight-line code without a speed check inside the timing. Only
+// the part of a slot that a late release or sample would corrupt runs with
+// interrupts disabled, the recovery time does not.
+
+OW_INLINE uint8_t reset_slot(const uint8_t od)
 {
   uint8_t data;
+  OW_DELAY(od, G);
   _low();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_H));
-  _high();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_I));
-  data = _sample();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_J));
+  OW_DELAY(od, H);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    _high();
+    OW_DELAY(od, I);
+    data = _sample();
+  }
+  OW_DELAY(od, J);
   return data;
 }
 
-void ow_write(uint8_t data)
+OW_INLINE void write_slot(uint8_t bit, const uint8_t od)
 {
-  for (uint8_t bit = 0; bit < 8; bit++)
+  if (bit)
   {
-    if (data & 0x01)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
       _low();
-      __builtin_avr_delay_cycles(usToCycles(OW_TIME_A) - _high_cycles);
+      OW_DELAY(od, A);
       _high();
-      __builtin_avr_delay_cycles(usToCycles(OW_TIME_B));
     }
-    else
+    OW_DELAY(od, B);
+  }
+  else
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
       _low();
-      __builtin_avr_delay_cycles(usToCycles(OW_TIME_C) - _high_cycles);
+      OW_DELAY(od, C);
       _high();
-      __builtin_avr_delay_cycles(usToCycles(OW_TIME_D));
     }
-    data >>= 1;
+    OW_DELAY(od, D);
   }
 }
 
-uint8_t ow_readBit(void)
+OW_INLINE uint8_t read_slot(const uint8_t od)
 {
   uint8_t data;
-  _low();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_A));
-  _high();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_E));
-  data = _sample();
-  __builtin_avr_delay_cycles(usToCycles(OW_TIME_F));
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    _low();
+    OW_DELAY(od, A);
+    _high();
+    OW_DELAY(od, E);
+    data = _sample();
+  }
+  OW_DELAY(od, F);
   return data;
 }
 
+/// @brief Send a reset and sample the presence pulse
+/// @return 0 if a device answered, 1 if not
+uint8_t ow_reset()
+{
+  if (ow_speed == OW_SPEED_OVERDRIVE)
+    return reset_slot(1);
+  return reset_slot(0);
+}
+
+void ow_writeBit(uint8_t bit)
+{
+  if (ow_speed == OW_SPEED_OVERDRIVE)
+    write_slot(bit, 1);
+  else
+    write_slot(bit, 0);
+}
+
+void ow_write(uint8_t data)
+{
+  for (uint8_t bit = 0; bit < 8; bit++)
+  {
+    ow_writeBit(data & 0x01);
+    data >>= 1;
+  }
+}
+
+uint8_t ow_readBit(void)
+{
+  if (ow_speed == OW_SPEED_OVERDRIVE)
+    return read_slot(1);
+  return read_slot(0);
+}
+
+/// @brief Select the speed of the following slots
+/// @details A reset at standard speed returns all devices to standard speed,
+/// use ow_overdriveSkip to bring them to overdrive
+void ow_setSpeed(uint8_t speed)
+{
+  ow_speed = speed;
+}
+
+/// @brief Put all overdrive capable devices in overdrive (OVERDRIVE SKIP ROM)
+/// @details Sent at standard speed, after it the bus runs at overdrive speed
+/// and the devices are addressed as after SKIP ROM. They stay in overdrive
+/// through overdrive resets until ow_setSpeed(OW_SPEED_STANDARD) and a reset.
+/// Devices without overdrive, like the DS18B20, stop answering until then.
+/// @return 0 if a device answered the reset, -1 if not
+int8_t ow_overdriveSkip(void)
+{
+  ow_speed = OW_SPEED_STANDARD;
+  if (ow_reset())
+    return -1;
+  ow_write(OW_CMD_OVERDRIVE_SKIP);
+  ow_speed = OW_SPEED_OVERDRIVE;
+  return 0;
+}
+
 uint8_t ow_read(void)
 {
   uint8_t data;
@@ -89,4 +179,93 @@ uint8_t ow_read(void)
       data |= 0x80;
   }
   return data;
-}
\ No newline at end of file
+}
+/// @brief Dallas/Maxim CRC-8 (x^8 + x^5 + x^4 + 1) of a block
+/// @return 0 when the block ends with the CRC of the bytes before it
+uint8_t ow_crc8(const uint8_t *data, uint8_t len)
+{
+  uint8_t crc = 0;
+  while (len--)
+    crc = _crc_ibutton_update(crc, *data++);
+  return crc;
+}
+
+/// @brief Address a single device with MATCH ROM
+/// @return 0 if a device answered the reset, -1 if not
+int8_t ow_select(const uint8_t *rom)
+{
+  if (ow_reset())
+    return -1;
+  ow_write(OW_CMD_MATCH);
+  for (uint8_t i = 0; i < OW_ROM_LENGTH; i++)
+    ow_write(rom[i]);
+  return 0;
+}
+
+/// @brief Start a ROM search
+void ow_searchInit(ow_search_t *search)
+{
+  search->last_discrepancy = 0;
+  search->done = 0;
+}
+
+/// @brief Find the next device on the bus (SEARCH ROM)
+/// @details Walks the ROM tree one branch per call, taking the 1 branch at the
+/// deepest discrepancy that was not taken yet (Maxim application note 187)
+/// @return 1 with the ROM of the device in search->rom, 0 when all devices
+/// were found or the bus did not answer properly
+uint8_t ow_searchNext(ow_search_t *search)
+{
+  uint8_t last_zero = 0;
+
+  if (search->done || ow_reset())
+  {
+    search->done = 1;
+    return 0;
+  }
+  ow_write(OW_CMD_SEARCH);
+
+  for (uint8_t bit = 1; bit <= OW_ROM_LENGTH * 8; bit++)
+  {
+    uint8_t *byte = &search->rom[(bit - 1) >> 3];
+    uint8_t mask = 1 << ((bit - 1) & 0x07);
+    uint8_t id = ow_readBit();
+    uint8_t cmp = ow_readBit();
+    uint8_t dir;
+
+    if (id && cmp)
+    {
+      // No device left on this branch
+      search->done = 1;
+      return 0;
+    }
+    if (id != cmp)
+      dir = id;
+    else
+    {
+      // Devices with a 0 and with a 1 here
+      if (bit < search->last_discrepancy)
+        dir = (*byte & mask) != 0;
+      else
+        dir = (bit == search->last_discrepancy);
+      if (!dir)
+        last_zero = bit;
+    }
+
+    if (dir)
+      *byte |= mask;
+    else
+      *byte &= ~mask;
+    ow_writeBit(dir);
+  }
+
+  search->last_discrepancy = last_zero;
+  if (!last_zero)
+    search->done = 1;
+  if (ow_crc8(search->rom, OW_ROM_LENGTH) != 0)
+  {
+    search->done = 1;
+    return 0;
+  }
+  return 1;
+}
@@ -5,77 +5,203 @@
 
 #include "board/mfm_sensor_module.h"
 #include "drivers/zacwire.h"
+#include "mcu/util.h"
+#include <string.h>
 
-#define IDLE_COUNTS 150 // 272us
+// Frame layout: every byte is a start bit, 8 data bits (MSB first) and a
+// parity bit. Each bit starts with a falling edge; the low time is a quarter
+// period for a 1, three quarters for a 0 and half a period for the start bit.
+#define PULSES_PER_BYTE 10
+
+// TCB0 counts CLK_PER, or CLK_PER/2 when that would overflow the 8 bit
+// widths (a 0 bit is ~24 us low)
+#if F_CPU > 8000000UL
+#define TIMER_CLKSEL TCB_CLKSEL_CLKDIV2_gc
+#define TIMER_HZ (F_CPU / 2)
+#else
+#define TIMER_CLKSEL TCB_CLKSEL_CLKDIV1_gc
+#define TIMER_HZ F_CPU
+#endif
+
+/// @brief Minimum high time before a frame, longer than the gap between the
+/// bytes of a frame; also the longest a frame may go without a falling edge
+#define IDLE_US 272
+#define IDLE_COUNTS ((uint16_t)(TIMER_HZ / 1000 * IDLE_US / 1000))
+
+/// @brief Shortest start bit (half a bit period) that is not a glitch
+#define MIN_HALF_US 4
+#define MIN_HALF_COUNTS ((uint8_t)(TIMER_HZ / 1000 * MIN_HALF_US / 1000))
+
+/// @brief Low time of every pulse of the frame being received, in timer
+/// counts (saturated at 255), filled by the capture interrupt
+static volatile uint8_t widths[ZACWIRE_MAX_BYTES * PULSES_PER_BYTE];
+static volatile uint8_t received = 0;
+static volatile uint8_t expected = 0;
+
+/// @brief Errors per class since the last zacwire_clearStats
+static zacwire_stats_t stats;
 
 /// @brief Initialize the zacwire bus
+/// @details TCB0 runs in pulse-width measurement mode on the inverted input:
+/// a falling edge restarts the counter and the rising edge captures it, so
+/// every capture is the low time of one bit. The capture interrupt has the
+/// high priority level, so the TWI or UART interrupts cannot delay it past
+/// the next bit.
 void zacwire_init() {
     // Set the pin as input
     ZACWIRE_PORT.DIRCLR = ZACWIRE_PIN;
-}
 
-inline void wait_for_idle(void) {
-    // Wait for bus idle
-    uint16_t idle = IDLE_COUNTS;
-    while (idle) {
-        if (ZACWIRE_PORT.IN & ZACWIRE_PIN)
-            idle--;
-        else
-            idle = IDLE_COUNTS;
-    }
-}
+    ZACWIRE_EVENT_CHANNEL = ZACWIRE_EVENT_GENERATOR;
+    ZACWIRE_EVENT_USER = ZACWIRE_EVENT_USER_CHANNEL;
 
-inline void wait_till_low(void) {
-    while (!(ZACWIRE_PORT.IN & ZACWIRE_PIN))
-        ;
-    while (ZACWIRE_PORT.IN & ZACWIRE_PIN)
-        ;
+    TCB0.CTRLB = TCB_CNTMODE_PW_gc;
+    TCB0.EVCTRL = TCB_CAPTEI_bm | TCB_EDGE_bm | TCB_FILTER_bm;
+    TCB0.INTCTRL = 0;
+    TCB0.CTRLA = TIMER_CLKSEL | TCB_ENABLE_bm;
+
+    CPUINT.LVL1VEC = TCB0_INT_vect_num;
 }
 
-inline void wait_till_duty(uint8_t cycles) {
-    while (cycles--)
-        __asm("nop");
+/// @brief Store the low time of a bit
+/// @details Kept as short as possible: a bit is only ~100 CPU cycles long
+ISR(TCB0_INT_vect) {
+    uint8_t n = received;
+    uint8_t width = TCB0.CCMPL;
+
+    if (TCB0.CCMPH)
+        width = 0xFF;
+    TCB0.INTFLAGS = TCB_CAPT_bm;
+    widths[n++] = width;
+    received = n;
+    if (n == expected)
+        TCB0.INTCTRL = 0;
 }
 
-void zacwire_read_byte(uint8_t *data, uint8_t *parity) {
-    uint8_t duty = 0;
-    uint8_t bits = 8;
-
-    // Measure half duty using start bit (not a data bit!)
-    wait_till_low();
-    while (!(ZACWIRE_PORT.IN & ZACWIRE_PIN))
-        duty++;
-
-    while (bits--) {
-        wait_till_low();
-        wait_till_duty(duty);
-        PORTA.OUTTGL = PIN1_bm;
-        // Sample
-        *data <<= 1;
-        if ((ZACWIRE_PORT.IN & ZACWIRE_PIN) > 0) {
-            *data |= 1;
-            *parity += 1;
+/// @brief Start capturing a frame if the bus is idle
+/// @details The counter restarts at every falling edge, so it holds the time
+/// since the last one; no interrupt can make this check miss an edge
+/// @return 1 when armed, 0 if the bus is not idle
+static uint8_t zacwire_arm(uint8_t count) {
+    uint8_t armed = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if ((ZACWIRE_PORT.IN & ZACWIRE_PIN) && TCB0.CNT >= IDLE_COUNTS) {
+            received = 0;
+            expected = count * PULSES_PER_BYTE;
+            TCB0.INTFLAGS = TCB_CAPT_bm;
+            TCB0.INTCTRL = TCB_CAPT_bm;
+            armed = 1;
         }
     }
-    wait_till_low();
-    wait_till_duty(duty);
-    if ((ZACWIRE_PORT.IN & ZACWIRE_PIN) > 0)
-        *parity += 1;
+    return armed;
 }
 
-/// @brief Read a byte from the bus
-/// @details Read a byte from the (32kHz) bus
-/// @param data pointer to the data byte
-/// @return validity of the data: 0 is valid, -1 is invalid
-/// @condition The bus is idle
-int8_t zacwire_read(uint8_t *data, uint8_t count) {
+/// @brief Decode the captured low times of one byte
+/// @details A bit is a 1 when its low time is shorter than that of the start
+/// bit of its byte, the same point the bus master is meant to sample at. A 1
+/// is nominally half and a 0 one and a half start bit long; anything outside
+/// a quarter to two start bits is a glitch, not a bit.
+/// @param width The 10 low times of the byte, starting with the start bit
+/// @return 0 if valid, ZACWIRE_ERR_GLITCH or ZACWIRE_ERR_PARITY
+static int8_t zacwire_decodeByte(const volatile uint8_t *width,
+                                 uint8_t *data) {
+    uint8_t half = width[0];
+    uint8_t byte = 0;
     uint8_t parity = 0;
+
+    if (half < MIN_HALF_COUNTS || half == 0xFF)
+        return ZACWIRE_ERR_GLITCH;
+
+    for (uint8_t i = 1; i < PULSES_PER_BYTE; i++) {
+        uint8_t w = width[i];
+        uint8_t bit = w < half;
+
+        if (w < half / 4 || w > 2 * (uint16_t)half)
+            return ZACWIRE_ERR_GLITCH;
+        // Data bits first, then the (even) parity bit
+        if (i <= 8)
+            byte = (byte << 1) | bit;
+        parity ^= bit;
+    }
+    if (parity)
+        return ZACWIRE_ERR_PARITY;
+
+    *data = byte;
+    return 0;
+}
+
+/// @brief Stop capturing and count the error
+static int8_t zacwire_fail(int8_t err) {
+    TCB0.INTCTRL = 0;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        wait_for_idle();
-        while (count--) {
-            zacwire_read_byte(data, &parity);
-            data++;
+        if (err == ZACWIRE_ERR_PARITY)
+            stats.parity++;
+        else if (err == ZACWIRE_ERR_GLITCH)
+            stats.glitch++;
+        else if (err == ZACWIRE_ERR_NO_FRAME)
+            stats.missing++;
+        else
+            stats.timeout++;
+    }
+    return err;
+}
+
+/// @brief Read bytes from the bus
+/// @details Read a frame from the (32kHz) bus. The edges are captured in the
+/// background and the CPU idles until the first one, interrupts stay
+/// enabled. Every byte is checked as soon as its last bit is in, so a bad
+/// frame is rejected without waiting for the rest of it.
+/// @param data pointer to the data bytes
+/// @param count number of bytes in the frame, at most ZACWIRE_MAX_BYTES
+/// @return 0 if valid; ZACWIRE_ERR_PARITY or ZACWIRE_ERR_GLITCH for a bad
+/// byte, ZACWIRE_ERR_NO_FRAME when the bus was not idle or no frame started
+/// within ZACWIRE_TIMEOUT ms, ZACWIRE_ERR_TIMEOUT when a frame stopped for
+/// longer than IDLE_US or did not end within ZACWIRE_TIMEOUT ms
+int8_t zacwire_read(uint8_t *data, uint8_t count) {
+    uint32_t deadline = millis() + ZACWIRE_TIMEOUT;
+    uint8_t decoded = 0;
+
+    if (count == 0 || count > ZACWIRE_MAX_BYTES)
+        return ZACWIRE_ERR_TIMEOUT;
+
+    // A gap is short, so wait for it without sleeping through it
+    while (!zacwire_arm(count)) {
+        if ((int32_t)(millis() - deadline) >= 0)
+            return zacwire_fail(ZACWIRE_ERR_NO_FRAME);
+    }
+
+    while (decoded < count) {
+        if (received >= (decoded + 1) * PULSES_PER_BYTE) {
+            int8_t err = zacwire_decodeByte(&widths[decoded * PULSES_PER_BYTE],
+                                            &data[decoded]);
+            if (err)
+                return zacwire_fail(err);
+            decoded++;
+            continue;
         }
+        if ((int32_t)(millis() - deadline) >= 0)
+            return zacwire_fail(received ? ZACWIRE_ERR_TIMEOUT
+                                         : ZACWIRE_ERR_NO_FRAME);
+        if (received && TCB0.CNT >= IDLE_COUNTS)
+            return zacwire_fail(ZACWIRE_ERR_TIMEOUT);
+        // Once the frame runs the edge timeout is far below a millisecond,
+        // so only the wait for its first edge sleeps
+        cli();
+        if (received)
+            sei();
+        else
+            cpu_idleUntil(deadline);
     }
-    return -(parity % 2);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { stats.frames++; }
+    return 0;
+}
+
+/// @brief Copy the frame and error counters
+void zacwire_getStats(zacwire_stats_t *s) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *s = stats; }
+}
+
+/// @brief Reset the frame and error counters
+void zacwire_clearStats(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { memset(&stats, 0, sizeof(stats)); }
 }
@@ -8,9 +8,15 @@
 
 uint8_t twi_buffer[TWI_BUFFER_LENGTH] = {0};
 volatile uint8_t twi_buffer_rx = 0;
-volatile uint8_t twi_buffer_tx = 0;
+volatile uint16_t twi_buffer_tx = 0;
 volatile uint8_t twi_busy = 0;
-volatile twi_cmd_t *twi_current_cmd;
+const twi_cmd_t *volatile twi_current_cmd;
+
+// Source of the bytes sent on a read, defaults to twi_buffer
+const uint8_t *twi_tx_data = twi_buffer;
+twi_producer_t twi_tx_producer = 0;
+uint16_t twi_tx_len = TWI_BUFFER_LENGTH;
+twi_transmitted_t twi_tx_done = 0;
 
 void twi_ack() { TWI0.SCTRLB = TWI_SCMD_RESPONSE_gc; }
 void twi_nack() { TWI0.SCTRLB = TWI_SCMD_RESPONSE_gc | TWI_ACKACT_NACK_gc; } //RESPONSE, NACK
@@ -22,6 +28,53 @@ void twi_end()
   twi_busy = 0;
 }
 
+/// @brief Send `len` bytes straight from `data` on the next read
+/// @details Called from a command handler instead of filling its buffer. The
+/// data is not copied, so it must not change until the read is done; the
+/// length is not limited by TWI_BUFFER_LENGTH
+void twi_transmit(const void *data, uint16_t len)
+{
+  twi_tx_data = data;
+  twi_tx_producer = 0;
+  twi_tx_len = len;
+}
+
+/// @brief Send `len` bytes produced one by one by `producer` on the next read
+/// @details Called from a command handler; `producer` runs in the ISR for
+/// every byte the master clocks out, in order
+void twi_transmitWith(twi_producer_t producer, uint16_t len)
+{
+  twi_tx_producer = producer;
+  twi_tx_len = len;
+}
+
+/// @brief Call `done` from the ISR once the master has read the response
+/// @details Called from a command handler after twi_transmit or
+/// twi_transmitWith. `done` only runs when at least one byte was read, not
+/// when a new write replaces the response first
+void twi_onTransmitted(twi_transmitted_t done)
+{
+  twi_tx_done = done;
+}
+
+// Respond from the buffer again
+static void twi_txReset()
+{
+  twi_tx_data = twi_buffer;
+  twi_tx_producer = 0;
+  twi_tx_len = TWI_BUFFER_LENGTH;
+  twi_tx_done = 0;
+}
+
+// End of a read, the response is consumed
+static void twi_txFinish()
+{
+  if (twi_tx_done)
+    twi_tx_done();
+  twi_txReset();
+  twi_buffer_tx = 0;
+}
+
 /// @brief Initialize the TWI interface
 /// @param addr The address of the device
 void twi_init(uint8_t addr, uint8_t enable_gc)
@@ -53,12 +106,16 @@ ISR(TWI0_TWIS_vect)
     return twi_end();
   }
 
+  // The response source set by a handler is kept across a STOP, so a master
+  // may read it in a separate transaction; it is dropped once read
   if (isStop)
   {
     if (twi_current_cmd) {
       twi_current_cmd->handler(twi_buffer, twi_buffer_rx);
             twi_current_cmd = 0;
         }
+    if (twi_buffer_tx)
+      twi_txFinish();
     return twi_end();
   }
 
@@ -69,6 +126,9 @@ ISR(TWI0_TWIS_vect)
       twi_current_cmd->handler(twi_buffer, twi_buffer_rx);
             twi_current_cmd = 0;
         }
+    // Restart after a read
+    if (twi_buffer_tx)
+      twi_txFinish();
 
     twi_busy = 1;
     twi_buffer_rx = 0;
@@ -81,19 +141,17 @@ ISR(TWI0_TWIS_vect)
   {
     if (twi_buffer_rx >= TWI_BUFFER_LENGTH)
       return twi_nack();
+    // A new command replaces a response that was never read
+    if (twi_buffer_rx == 0)
+      twi_txReset();
     twi_buffer[twi_buffer_rx++] = TWI0.SDATA;
 
     // Find command handler
     if (twi_buffer_rx == 1)
     {
-      for (uint8_t i = 0; i < TWI_CMD_COUNT; i++)
-      {
-        if (twi_cmds[i].cmd == twi_buffer[0])
-        {
-          twi_current_cmd = &twi_cmds[i];
-          break;
-        }
-      }
+      uint8_t i = twi_cmd_lut[twi_buffer[0]];
+      if (i)
+        twi_current_cmd = &twi_cmds[i - 1];
     }
 
     // ACK if command is found
@@ -105,10 +163,14 @@ ISR(TWI0_TWIS_vect)
 
   if (isRead)
   {
-    if ((twi_buffer_tx && rxnack) || twi_buffer_tx >= TWI_BUFFER_LENGTH)
+    if ((twi_buffer_tx && rxnack) || twi_buffer_tx >= twi_tx_len)
       return twi_complete();
 
-    TWI0.SDATA = twi_buffer[twi_buffer_tx++];
+    if (twi_tx_producer)
+      TWI0.SDATA = twi_tx_producer();
+    else
+      TWI0.SDATA = twi_tx_data[twi_buffer_tx];
+    twi_buffer_tx++;
     return twi_ack();
   }
 
@@ -3,87 +3,241 @@
 //
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "board/mfm_sensor_module.h"
 #include "mcu/uart.h"
+#include "mcu/util.h"
+#include "os/lock.h"
 #include <string.h>
 
-/// @brief Calculate the baud rate register value
-#define USART_BAUD_RATE(BAUD_RATE)     ((float)(64 * F_CPU / (16 * (float)BAUD_RATE)) + 0.5)
+#if (UART_RX_BUFFER_LENGTH & (UART_RX_BUFFER_LENGTH - 1)) != 0
+#error "UART_RX_BUFFER_LENGTH must be a power of two"
+#endif
+#if (UART_TX_BUFFER_LENGTH & (UART_TX_BUFFER_LENGTH - 1)) != 0
+#error "UART_TX_BUFFER_LENGTH must be a power of two"
+#endif
+
+#define RX_MASK (UART_RX_BUFFER_LENGTH - 1)
+#define TX_MASK (UART_TX_BUFFER_LENGTH - 1)
+
+// Transmit ring buffer, emptied by the DRE interrupt
+static volatile uint8_t tx_buffer[UART_TX_BUFFER_LENGTH];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+// Set once a character was queued, TXCIF is only meaningful after that
+static uint8_t tx_used = 0;
+
+// Receive ring buffer, filled by the RXC interrupt
+static volatile uint8_t rx_buffer[UART_RX_BUFFER_LENGTH];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+// Number of carriage returns (complete lines) in the buffer
+static volatile uint8_t rx_lines = 0;
+
+/// @brief Calculate the baud rate register value (64 * F_CPU / (16 * baud)),
+/// rounded; integer only so it also works for a run-time baud rate
+#define USART_BAUD_RATE(BAUD_RATE)                                             \
+  ((4UL * F_CPU + (BAUD_RATE) / 2) / (BAUD_RATE))
 
 /// @brief Initialize the UART
 /// @details This function will initialize the UART with the following settings:
-/// - Baud rate: 9600
+/// - Baud rate: `baud`
 /// - Data bits: 8
 /// - Parity: None
 /// - Stop bits: 1
-/// Default pins are used for the UART
-void uart_init(void)
+/// Default pins are used for the UART. Received characters are stored by the
+/// RXC interrupt until they are read. Calling it again changes the baud rate
+/// and drops everything buffered. The UART holds an OS lock until it is
+/// disabled, so the CPU does not sleep in STANDBY and stop its clock.
+/// @param baud Baud rate, UART_MAX_BAUD at most
+void uart_init(uint32_t baud)
 {
-  USART0.BAUD = USART_BAUD_RATE(9600);
+  uart_flush();
+  tx_head = tx_tail = 0;
+  tx_used = 0;
+
+  USART0.BAUD = USART_BAUD_RATE(baud);
 
   USART_PORT.DIR &= ~USART_RX_PIN;
   USART_PORT.DIR |= USART_TX_PIN;
 
+  USART0.CTRLA |= USART_RXCIE_bm;
   USART0.CTRLB |= USART_TXEN_bm;
   USART0.CTRLB |= USART_RXEN_bm;
+  os_lock(os_lock_uart);
 
 //  PORTMUX.CTRLB |= USART_DEFAULT_PINS; // select default pins for usart
 //  PORTMUX.CTRLB = 0x01; // select alternate pins for usart
 }
 
 /// @brief Disable the UART by setting the RX and TX pins as input
+/// @details Characters still queued for transmission are dropped; use
+/// uart_waitTx first to send them
 void uart_disable() {
+  USART0.CTRLA &= ~(USART_RXCIE_bm | USART_DREIE_bm);
   USART0.CTRLB &= ~(USART_TXEN_bm | USART_RXEN_bm);
   USART_PORT.DIR &= ~USART_RX_PIN;
   USART_PORT.DIR &= ~USART_TX_PIN;
+  os_unlock(os_lock_uart);
+}
+
+/// @brief Disable the UART but keep driving TX at its idle (high) level
+/// @details For a peer that stays powered: a floating TX line could be seen as
+/// a character, which wakes an EZO circuit from its sleep
+void uart_suspend(void) {
+  uart_disable();
+  USART_PORT.OUTSET = USART_TX_PIN;
+  USART_PORT.DIRSET = USART_TX_PIN;
 }
 
-/// @brief Send a character over the UART
+/// @brief Queue a character for transmission
 /// @param c The character to be sent
+/// @Note Only waits (idling) when the transmit buffer is full
 void uart_sendChar(char c)
 {
-  while(!(USART0.STATUS & USART_DREIF_bm))
+  uint8_t next = (tx_head + 1) & TX_MASK;
+
+  while (next == tx_tail)
   {
-    ;
+    cpu_idle();
   }
 
-  USART0.TXDATAL = c;
+  tx_buffer[tx_head] = c;
+  tx_used = 1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tx_head = next;
+    // Clear the transmit complete flag, uart_txDone uses it
+    USART0.STATUS = USART_TXCIF_bm;
+    USART0.CTRLA |= USART_DREIE_bm;
+  }
 }
 
-/// @brief Send a string over the UART
+/// @brief Queue a string for transmission
+/// @details Returns as soon as the string is in the transmit buffer, the DRE
+/// interrupt sends it in the background. Use uart_txDone or uart_waitTx to
+/// know when it is on the line.
 /// @param str Pointer to the string to be sent
 void uart_sendString(char *str)
 {
-  for(size_t ii = 0; ii < strlen(str); ii++)
+  while (*str)
   {
-    uart_sendChar(str[ii]);
+    uart_sendChar(*str++);
   }
 }
 
-/// @brief Read a character from the UART
-/// @return The received character
-/// @Note This function will block until a character is received
-uint8_t uart_read()
+/// @brief Check if all queued characters have been sent
+/// @return 1 when the transmit buffer is empty and the last stop bit is out
+uint8_t uart_txDone(void)
+{
+  if (tx_head != tx_tail)
+    return 0;
+  return !tx_used || (USART0.STATUS & USART_TXCIF_bm);
+}
+
+/// @brief Wait until all queued characters have been sent
+/// @param deadline millis() at which to give up
+/// @return 1 when done, 0 if the deadline passed
+uint8_t uart_waitTx(uint32_t deadline)
+{
+  while (1)
+  {
+    cli();
+    if (uart_txDone())
+      break;
+    if ((int32_t)(millis() - deadline) >= 0)
+    {
+      sei();
+      return 0;
+    }
+    cpu_idleUntil(deadline);
+  }
+  sei();
+  return 1;
+}
+
+/// @brief Wait until a character is in the receive buffer
+/// @return 1 if a character is available, 0 if the deadline passed
+static uint8_t uart_wait(uint32_t deadline)
+{
+  while (1)
+  {
+    cli();
+    if (rx_head != rx_tail)
+      break;
+    if ((int32_t)(millis() - deadline) >= 0)
+    {
+      sei();
+      return 0;
+    }
+    cpu_idleUntil(deadline);
+  }
+  sei();
+  return 1;
+}
+
+/// @brief Take the oldest character from the receive buffer
+/// @Note The buffer must not be empty
+static uint8_t uart_pop(void)
+{
+  uint8_t c = rx_buffer[rx_tail];
+  rx_tail = (rx_tail + 1) & RX_MASK;
+  if (c == 0x0D)
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { rx_lines--; }
+  }
+  return c;
+}
+
+/// @brief Number of received characters that have not been read
+uint8_t uart_available(void)
+{
+  return (rx_head - rx_tail) & RX_MASK;
+}
+
+/// @brief Check if a complete line (ending in a carriage return) was received
+uint8_t uart_lineAvailable(void)
 {
-  while (!(USART0.STATUS & USART_RXCIF_bm))
+  return rx_lines > 0;
+}
+
+/// @brief Drop all received characters
+void uart_flush(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    ;
+    rx_tail = rx_head;
+    rx_lines = 0;
   }
-  return USART0.RXDATAL;
+}
+
+/// @brief Read a character from the UART
+/// @param deadline millis() at which to give up
+/// @return The received character, UART_TIMEOUT if none arrived in time
+/// @Note The CPU idles while waiting
+int16_t uart_read(uint32_t deadline)
+{
+  if (!uart_wait(deadline))
+    return UART_TIMEOUT;
+  return uart_pop();
 }
 
 /// @brief Read a line from the UART
 /// @details This function will read a line from the UART and store it in a buffer. The last character will be '\0'
-/// @return Pointer to the buffer
-/// @Note This function will block until a carriage return is received or the maximum line length (10 chars) is reached
-char* uart_readline() {
+/// @param deadline millis() at which to give up
+/// @return Pointer to the buffer, 0 if no complete line arrived in time
+/// @Note This function will idle until a carriage return is received, the maximum line length (10 chars) is reached
+/// or the deadline passes
+char* uart_readline(uint32_t deadline) {
   static char line[MAX_RX_LINE_LENGTH];
   uint8_t i = 0;
 
   while (1) {
-    while (!(USART0.STATUS & USART_RXCIF_bm)); // Wait for data to be received
-    uint8_t data = USART0.RXDATAL; // Read the data
+    if (!uart_wait(deadline)) // Wait for data to be received
+      return 0;
+    uint8_t data = uart_pop(); // Read the data
 
     if (data == 0x0D || i == MAX_RX_LINE_LENGTH - 1) { // If carriage return or end of buffer
       line[i] = '\0'; // Null-terminate the string
@@ -95,3 +249,33 @@ char* uart_readline() {
 
   return line;
 }
+
+/// @brief Store received characters in the receive buffer
+/// @details Characters that do not fit are dropped
+ISR(USART0_RXC_vect)
+{
+  uint8_t c = USART0.RXDATAL;
+  uint8_t next = (rx_head + 1) & RX_MASK;
+
+  if (next == rx_tail)
+    return;
+
+  rx_buffer[rx_head] = c;
+  rx_head = next;
+  if (c == 0x0D)
+    rx_lines++;
+}
+
+/// @brief Move the next queued character to the transmitter
+/// @details Disables itself when the transmit buffer is empty
+ISR(USART0_DRE_vect)
+{
+  if (tx_head == tx_tail)
+  {
+    USART0.CTRLA &= ~USART_DREIE_bm;
+    return;
+  }
+
+  USART0.TXDATAL = tx_buffer[tx_tail];
+  tx_tail = (tx_tail + 1) & TX_MASK;
+}
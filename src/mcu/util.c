@@ -1,95 +1,215 @@
 #include "../../include/mcu/util.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/atomic.h>
 #include <avr/xmega.h>
 
-#ifndef F_CPU
-#define F_CPU 1000000UL
-#endif
+#include "os/lock.h"
 
-#define cyclesToUs(cycles) ((cycles * 1000000UL) / F_CPU)
+// The RTC counts the 32.768 kHz internal ULP oscillator, which keeps running
+// in STANDBY; it overflows every 65536 ticks, exactly 2 seconds
+#define MS_PER_OVF 2000UL
+#define US_PER_OVF 2000000UL
 
-#define TCA0_OVF 256
-#define TCA0_DIV 16
-#define TCA0_DIV_gc TCA_SINGLE_CLKSEL_DIV16_gc
-
-#define US_PER_TICK cyclesToUs(TCA0_DIV)          // 16 us at 4MHz
-#define US_PER_OVF cyclesToUs(TCA0_OVF *TCA0_DIV) // 1024 us at 4MHz
-#define MS_PER_OVF (US_PER_OVF / 1000)
-#define MS_FRACT_OVF ((US_PER_OVF % 1000) >> 3)
-#define MS_FRACT_MAX (1000 >> 3)
-
-volatile unsigned long timer_millis = 0;
-volatile unsigned long timer_overflow = 0;
-volatile unsigned char timer_millis_fract = 0;
+// Number of RTC overflows, the upper part of the time
+volatile uint32_t rtc_overflows = 0;
 
+/// @brief Initialize the timekeeping
+/// @details Runs the RTC from the internal 32.768 kHz oscillator, also in
+/// STANDBY, so time keeps counting while the CPU sleeps or has interrupts
+/// disabled; only its overflow every 2 seconds needs the interrupt. The
+/// oscillator is less accurate than the main clock (a few percent), an
+/// external crystal cannot be used as its pins carry the UART. TCB1 counts
+/// CPU cycles for the short delays and timestamps.
 void delay_init(void)
 {
-  // Initialize timer
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    TCA0.SINGLE.INTCTRL = TCA_SINGLE_OVF_bm;
-    TCA0.SINGLE.CTRLB = TCA_SINGLE_WGMODE_NORMAL_gc;
-    TCA0.SINGLE.PER = TCA0_OVF;
-    TCA0.SINGLE.CTRLA = TCA0_DIV_gc | TCA_SINGLE_ENABLE_bm;
+    while (RTC.STATUS)
+      ;
+    RTC.CLKSEL = RTC_CLKSEL_INT32K_gc;
+    RTC.PER = 0xFFFF;
+    RTC.CNT = 0;
+    RTC.INTFLAGS = RTC_OVF_bm | RTC_CMP_bm;
+    RTC.INTCTRL = RTC_OVF_bm;
+    RTC.CTRLA = RTC_PRESCALER_DIV1_gc | RTC_RUNSTDBY_bm | RTC_RTCEN_bm;
+
+    // Free-running tick counter for delay_us and tick_now
+    TCB1.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB1.CCMP = 0xFFFF;
+    TCB1.CNT = 0;
+    TCB1.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
   }
   sei();
 }
 
-uint32_t millis(void)
+/// @brief Read the RTC counter and its overflows as one value
+/// @details An overflow that happened while interrupts are disabled is
+/// counted here, so the time never steps back
+static void rtc_read(uint32_t *overflows, uint16_t *count)
 {
-  uint32_t v;
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    v = timer_millis;
+    *count = RTC.CNT;
+    *overflows = rtc_overflows;
+    if (RTC.INTFLAGS & RTC_OVF_bm)
+    {
+      *count = RTC.CNT;
+      (*overflows)++;
+    }
   }
-  return v;
 }
 
+uint32_t millis(void)
+{
+  uint32_t o;
+  uint16_t c;
+
+  rtc_read(&o, &c);
+  // 1000 / 32768 = 125 / 4096
+  return o * MS_PER_OVF + (((uint32_t)c * 125) >> 12);
+}
+
+/// @brief Microseconds since delay_init, in steps of one RTC tick (~30.5 us)
 uint32_t micros(void)
 {
-  uint32_t c, o;
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  uint32_t o;
+  uint16_t c;
+
+  rtc_read(&o, &c);
+  // 1000000 / 32768 = 15625 / 512
+  return o * US_PER_OVF + (((uint32_t)c * 15625) >> 9);
+}
+
+/// @brief Make the RTC wake the CPU when millis() reaches `deadline`
+/// @details Deadlines past the current RTC period are not armed, the overflow
+/// interrupt wakes the CPU before them and the caller arms again. Can be
+/// called with interrupts disabled.
+/// @return 1 if the deadline is in the future, 0 if it has passed
+uint8_t cpu_wakeAt(uint32_t deadline)
+{
+  int32_t ms = (int32_t)(deadline - millis());
+
+  if (ms <= 0)
+    return 0;
+  if (ms < (int32_t)MS_PER_OVF)
   {
-    c = TCA0.SINGLE.CNT;
-    o = timer_overflow;
+    // Rounded up, waking a tick late is harmless but early costs a wakeup
+    uint16_t ticks = ((uint32_t)ms * 4096 + 124) / 125;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      while (RTC.STATUS & RTC_CMPBUSY_bm)
+        ;
+      RTC.CMP = RTC.CNT + ticks;
+      RTC.INTFLAGS = RTC_CMP_bm;
+      RTC.INTCTRL |= RTC_CMP_bm;
+    }
   }
+  return 1;
+}
 
-  return ((o * TCA0_OVF) + c) * (US_PER_TICK);
+/// @brief Sleep until an interrupt or until millis() reaches `deadline`
+/// @details Interrupts are enabled by the instruction before the sleep, so an
+/// interrupt pending since the caller checked its condition wakes it at once
+static void cpu_sleep(uint8_t mode, uint32_t deadline)
+{
+  if (cpu_wakeAt(deadline))
+  {
+    set_sleep_mode(mode);
+    sei();
+    sleep_cpu();
+  }
+  sei();
 }
 
+/// @brief Idle the CPU until the next interrupt
+/// @details Does nothing when interrupts are disabled, as nothing could wake
+/// it up. Only for waits that an interrupt is certain to end; a wait for a
+/// deadline uses cpu_idleUntil or cpu_sleepUntil.
+void cpu_idle(void)
+{
+  if (SREG & CPU_I_bm)
+  {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_cpu();
+  }
+}
+
+/// @brief Idle the CPU until the next interrupt or `deadline` (millis())
+/// @details The peripherals keep their clock, so a UART or timer capture
+/// keeps running. Call it with interrupts disabled, after checking what is
+/// waited for; it returns with interrupts enabled. Callers check their
+/// condition and the deadline in a loop around it.
+void cpu_idleUntil(uint32_t deadline)
+{
+  cpu_sleep(SLEEP_MODE_IDLE, deadline);
+}
+
+/// @brief Put the CPU in STANDBY until the next interrupt or `deadline`
+/// @details Stops the peripheral clock, so only used for plain waits; while
+/// an OS lock is held (a TWI transfer or the UART in use) it idles instead.
+/// Called like cpu_idleUntil.
+void cpu_sleepUntil(uint32_t deadline)
+{
+  cpu_sleep(os_hasLock() ? SLEEP_MODE_IDLE : SLEEP_MODE_STANDBY, deadline);
+}
+
+/// @brief Wait for `ms` milliseconds
+/// @details Sleeps in STANDBY until the RTC compare match when nothing needs
+/// the peripheral clock
 void delay_ms(uint32_t ms)
 {
-  uint32_t start = millis();
+  uint32_t deadline = millis() + ms;
+  uint8_t sleep = SREG & CPU_I_bm;
 
-  while ((millis() - start) < ms)
+  while ((int32_t)(millis() - deadline) < 0)
+  {
+    // Nothing could wake it with interrupts disabled, spin instead
+    if (sleep)
+    {
+      cli();
+      cpu_sleepUntil(deadline);
+    }
+  }
+}
+
+/// @brief Wait until `ticks` TCB1 ticks after `start`, busy
+/// @details Waits are split in half periods, so the 16 bit difference never
+/// wraps; an interrupt only delays the return, never adds to the wait
+/// @param start tick_now() the wait is relative to
+void delay_ticks(uint16_t start, uint32_t ticks)
+{
+  while (ticks > 0x8000)
+  {
+    while ((uint16_t)(tick_now() - start) < 0x8000)
+      ;
+    start += 0x8000;
+    ticks -= 0x8000;
+  }
+  while ((uint16_t)(tick_now() - start) < (uint16_t)ticks)
     ;
 }
 
-void delay_us(uint32_t us)
+/// @brief Wait for `us` microseconds, busy, on TCB1
+/// @details The start is taken before the conversion, so its cost is part of
+/// the wait; used by delay_us for long or variable delays
+void delay_usTimer(uint32_t us)
 {
-  uint32_t start = micros();
+  uint16_t start = tick_now();
 
-  while ((micros() - start) < us)
-    ;
+  delay_ticks(start, (us * TICKS_PER_US_Q10) >> 10);
 }
 
-// Timer overflow
-ISR(TCA0_OVF_vect)
+/// @brief RTC overflow and compare match
+/// @details The compare match only wakes the CPU, so it is disabled again
+ISR(RTC_CNT_vect)
 {
-  volatile unsigned long m = timer_millis;
-  volatile unsigned char f = timer_millis_fract;
+  uint8_t flags = RTC.INTFLAGS;
 
-  m += MS_PER_OVF;
-  f += MS_FRACT_OVF;
-  if (f >= MS_FRACT_MAX)
-  {
-    f -= MS_FRACT_MAX;
-    m++;
-  }
-  timer_overflow++;
-  timer_millis = m;
-  timer_millis_fract = f;
-  TCA0.SINGLE.INTFLAGS = TCA_SINGLE_OVF_bm;
+  if (flags & RTC_OVF_bm)
+    rtc_overflows++;
+  if (flags & RTC_CMP_bm)
+    RTC.INTCTRL &= ~RTC_CMP_bm;
+  RTC.INTFLAGS = flags;
 }
@@ -5,16 +5,27 @@
 #include <avr/wdt.h>
 #include <util/atomic.h>
 
-uint8_t os_isBusy(void) { return (os_hasLock()); }
+uint8_t os_isBusy(void) { return (os_hasLock() || os_hasReadyTasks()); }
 
 void os_init(void) {
-  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  set_sleep_mode(SLEEP_MODE_STANDBY);
   sleep_enable();
 }
 
+/// @brief Sleep until the next interrupt or task deadline
+/// @details Does not sleep while a lock is held or a task is ready. The CPU
+/// goes to STANDBY, where the RTC that drives millis() keeps counting: an RTC
+/// compare match wakes it at the first task deadline and the main loop hands
+/// the expired task to os_processTasks. Otherwise only an external interrupt
+/// (TWI address match) or the RTC overflow every 2 seconds wakes it. Power
+/// down would stop the RTC and with it the time.
 void os_sleep(void) {
+  uint32_t deadline;
+
   cli();
-  if (!os_isBusy()) {
+  if (!os_isBusy() &&
+      (!os_nextDeadline(&deadline) || cpu_wakeAt(deadline))) {
+    set_sleep_mode(SLEEP_MODE_STANDBY);
     os_presleep();
     sei();
     sleep_cpu();
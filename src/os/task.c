@@ -0,0 +1,154 @@
+#include "os/task.h"
+#include "mcu/util.h"
+
+#include <util/atomic.h>
+
+// Tasks that are ready to run, in FIFO order
+static os_task_t *ready_head = 0;
+static os_task_t *ready_tail = 0;
+// Tasks waiting for a deadline, sorted by deadline (earliest first)
+static os_task_t *timers = 0;
+
+/// @brief Deadline comparison that survives millis() wrapping around
+#define DEADLINE_REACHED(now, deadline) ((int32_t)((now) - (deadline)) >= 0)
+
+// All list helpers below expect interrupts to be disabled
+
+static void ready_push(os_task_t *t) {
+  t->next = 0;
+  t->state = os_task_ready;
+  if (ready_tail)
+    ready_tail->next = t;
+  else
+    ready_head = t;
+  ready_tail = t;
+}
+
+static os_task_t *ready_pop(void) {
+  os_task_t *t = ready_head;
+  if (t) {
+    ready_head = t->next;
+    if (!ready_head)
+      ready_tail = 0;
+    t->next = 0;
+    t->state = os_task_idle;
+  }
+  return t;
+}
+
+static void unlink(os_task_t *t) {
+  os_task_t **head = (t->state == os_task_ready) ? &ready_head : &timers;
+  os_task_t *prev = 0;
+
+  if (t->state == os_task_idle)
+    return;
+
+  for (os_task_t *it = *head; it; prev = it, it = it->next) {
+    if (it != t)
+      continue;
+    if (prev)
+      prev->next = t->next;
+    else
+      *head = t->next;
+    if (t == ready_tail)
+      ready_tail = prev;
+    break;
+  }
+  t->next = 0;
+  t->state = os_task_idle;
+}
+
+static void timer_insert(os_task_t *t) {
+  os_task_t **it = &timers;
+  while (*it && DEADLINE_REACHED(t->deadline, (*it)->deadline))
+    it = &(*it)->next;
+  t->next = *it;
+  t->state = os_task_waiting;
+  *it = t;
+}
+
+/// @brief Register a task with its function
+/// @param t The task, must stay valid while it is queued
+/// @param fn Function to run when the task becomes ready
+void os_taskInit(os_task_t *t, os_task_fn_t fn) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    unlink(t);
+    t->fn = fn;
+    t->deadline = 0;
+  }
+}
+
+/// @brief Make a task ready to run on the next os_processTasks
+/// @details Safe to call from an ISR. A waiting task is moved to the ready
+/// queue, posting an already ready task does nothing.
+void os_taskPost(os_task_t *t) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (t->state != os_task_ready) {
+      unlink(t);
+      ready_push(t);
+    }
+  }
+}
+
+/// @brief Run a task once `ms` milliseconds have passed
+/// @details Re-posting a queued task replaces its previous deadline
+void os_taskPostDelayed(os_task_t *t, uint32_t ms) {
+  os_taskPostAt(t, millis() + ms);
+}
+
+/// @brief Run a task once millis() reaches `deadline`
+void os_taskPostAt(os_task_t *t, uint32_t deadline) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    unlink(t);
+    t->deadline = deadline;
+    timer_insert(t);
+  }
+}
+
+/// @brief Remove a task from the ready queue or timer list
+void os_taskCancel(os_task_t *t) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { unlink(t); }
+}
+
+/// @brief Check if a task is ready or waiting for its deadline
+uint8_t os_taskIsQueued(os_task_t *t) { return t->state != os_task_idle; }
+
+uint8_t os_hasReadyTasks(void) { return ready_head != 0; }
+
+uint8_t os_hasPendingTimers(void) { return timers != 0; }
+
+/// @brief Get the deadline of the first waiting task
+/// @param deadline Set to the earliest deadline when a timer is pending
+/// @return 1 if a timer is pending, 0 if not
+uint8_t os_nextDeadline(uint32_t *deadline) {
+  uint8_t pending = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (timers) {
+      *deadline = timers->deadline;
+      pending = 1;
+    }
+  }
+  return pending;
+}
+
+/// @brief Run the first ready task, after readying tasks whose deadline passed
+/// @details Runs a single task per call so the main loop kicks the watchdog
+/// between tasks that each block for seconds; tasks posted by the running task
+/// run on a later call, so a task that keeps re-posting itself cannot starve
+/// the main loop
+void os_processTasks(void) {
+  os_task_t *t;
+  uint32_t now = millis();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    while (timers && DEADLINE_REACHED(now, timers->deadline)) {
+      t = timers;
+      timers = t->next;
+      ready_push(t);
+    }
+    t = ready_pop();
+  }
+
+  if (t)
+    t->fn();
+}
@@ -5,15 +5,97 @@
 #include "perif/atlas_ezo_ec.h"
 #include "board/mfm_sensor_module.h"
 #include "mcu/uart.h"
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
 #include <avr/io.h>
 #include <mcu/util.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <util/atomic.h>
 #include <util/delay.h>
 
+/// @brief Driver state, advanced by atlas_ezo_ec_process
+static struct {
+    uint8_t state;    // atlas_ezo_ec_state_t
+    uint8_t response; // atlas_ezo_ec_response_t of the last boot/command
+    uint8_t received; // A reading line arrived for the pending R/RT
+    uint32_t deadline;
+    uint32_t value;   // Last reading, uS/cm * 100
+    uint8_t woken;    // Powered up by a wake rather than a boot
+    uint8_t timed;    // The latency of this power up was recorded
+    uint32_t poweredUp; // millis() at power on or wake
+} ezo = {atlas_ezo_ec_off, atlas_ezo_ec_busy, 0, 0, ATLAS_EZO_EC_INVALID};
+
+/// @brief Cost of booting (atlas_ezo_ec_power_off) and of waking
+/// (atlas_ezo_ec_power_sleep) the circuit
+static atlas_ezo_ec_power_stats_t stats[2];
+
+static atlas_ezo_ec_response_t atlas_ezo_ec_command_(const char *cmd);
+
+// Settings the circuit is known to have, bits of atlas_ezo_ec_cache_t.known
+#define SETTING_K 0x01          // applied.k
+#define SETTING_LED 0x02        // applied.led
+#define SETTING_CONTINUOUS 0x04 // Continuous reading disabled (C,0)
+#define SETTING_OUTPUTS 0x08    // Only EC in the output string (O,)
+
+/// @brief What the circuit is known to have stored, and what we want it to
+/// have; mirrored in EEPROM so it survives a reset of the MCU
+typedef struct atlas_ezo_ec_cache {
+    uint8_t version; // ATLAS_EZO_EC_SETTINGS_VERSION
+    uint8_t known;   // SETTING_*
+    uint8_t baud;    // Index in rates of the last rate the circuit answered at
+    atlas_ezo_ec_settings_t desired;
+    atlas_ezo_ec_settings_t applied;
+} atlas_ezo_ec_cache_t;
+
+static atlas_ezo_ec_cache_t EEMEM ee_cache;
+static atlas_ezo_ec_cache_t cache;
+
+#if ATLAS_EZO_EC_BAUD > UART_MAX_BAUD
+#error "ATLAS_EZO_EC_BAUD is too fast for F_CPU"
+#endif
+
+/// @brief Baud rates of the circuit the driver can use, the first one is its
+/// factory default
+static const uint32_t rates[] = {9600, 19200, 38400, 57600, 115200};
+#define RATE_COUNT (sizeof(rates) / sizeof(rates[0]))
+
+/// @brief Index in rates the UART uses for the circuit
+/// @details Starts at the rate stored in the cache; moves on to the next rate
+/// when the circuit does not answer, but is only stored once it does
+static uint8_t baud = 0;
+/// @brief Set when Baud,n failed, it is not tried again until a reset
+static uint8_t baudFailed = 0;
+
+/// @brief Compensation temperature (tenths of a degree) the circuit used for
+/// its last reading
+/// @details Kept in RAM only: it changes with nearly every sample, which would
+/// wear out the EEPROM. It is forgotten whenever the circuit loses power.
+static int16_t compensation;
+static uint8_t compensationKnown = 0;
+
+/// @brief Write the settings cache back, only changed bytes are written
+static void atlas_ezo_ec_storeCache(void) {
+    eeprom_update_block(&cache, &ee_cache, sizeof(cache));
+}
+
 /// @brief Initialize the Atlas Scientific EZO EC
+/// @details Loads the settings cache from EEPROM. A blank EEPROM or a cache
+/// of another layout version is replaced with the defaults, nothing known.
 void atlas_ezo_ec_init(void) {
+    eeprom_read_block(&cache, &ee_cache, sizeof(cache));
+    if (cache.version != ATLAS_EZO_EC_SETTINGS_VERSION ||
+        cache.baud >= RATE_COUNT) {
+        cache.version = ATLAS_EZO_EC_SETTINGS_VERSION;
+        cache.known = 0;
+        cache.baud = 0;
+        cache.desired.k = ATLAS_EZO_EC_DEFAULT_K;
+        cache.desired.led = ATLAS_EZO_EC_DEFAULT_LED;
+        cache.applied = cache.desired;
+        atlas_ezo_ec_storeCache();
+    }
+    baud = cache.baud;
     atlas_ezo_ec_disable();
 }
 
@@ -25,130 +107,641 @@ void atlas_ezo_ec_disable() {
     // Set enable pin as input; pull-down will turn the isolator board off
     ENABLE_CONDUCTIVITY_PORT.DIRCLR = ENABLE_CONDUCTIVITY_PIN;
     uart_disable();
+    ezo.state = atlas_ezo_ec_off;
+    compensationKnown = 0;
 }
 
 /// @brief Enable the Atlas Scientific EZO EC
 /// @details This function will enable the Atlas Scientific EZO EC by setting
-/// the enable pin high
+/// the enable pin high. It does not wait for the circuit to boot, so other
+/// work can be done while it does; the driver is busy until the *RE banner
+/// arrives or ATLAS_EZO_EC_BOOT_TIMEOUT passes
 void atlas_ezo_ec_enable() {
     // Set enable pin as input; pull-up will turn the isolator board off
     ENABLE_CONDUCTIVITY_PORT.DIRSET = ENABLE_CONDUCTIVITY_PIN;
     ENABLE_CONDUCTIVITY_PORT.OUTSET = ENABLE_CONDUCTIVITY_PIN;
-    uart_init();
-    atlas_ezo_ec_waitForBoot();
+    uart_init(rates[baud]);
+    ezo.state = atlas_ezo_ec_booting;
+    ezo.response = atlas_ezo_ec_busy;
+    ezo.deadline = millis() + ATLAS_EZO_EC_BOOT_TIMEOUT;
+    ezo.woken = 0;
+    ezo.timed = 0;
+    ezo.poweredUp = millis();
 }
 
-/// @brief Send command to the Atlas Scientific EZO EC
-/// @param cmd Pointer to a string that holds the command
-static void atlas_ezo_ec_sendCommandAndWaitForResponse(char *cmd) {
-    uart_sendString(cmd);
-    uart_readline();
+/// @brief Wake the circuit from its Sleep state
+/// @details Any character wakes it, it answers with *WA. Like
+/// atlas_ezo_ec_enable this does not wait; the driver is busy until the *WA
+/// arrives or ATLAS_EZO_EC_WAKE_TIMEOUT passes.
+static void atlas_ezo_ec_wake(void) {
+    uart_init(rates[baud]);
+    uart_sendChar('\r');
+    ezo.state = atlas_ezo_ec_booting;
+    ezo.response = atlas_ezo_ec_busy;
+    ezo.deadline = millis() + ATLAS_EZO_EC_WAKE_TIMEOUT;
+    ezo.woken = 1;
+    ezo.timed = 0;
+    ezo.poweredUp = millis();
 }
 
-#define TIMEOUT 100 // Timeout in milliseconds
+/// @brief Add a sample to a running average
+static void atlas_ezo_ec_average(uint16_t *average, uint32_t sample,
+                                 uint16_t count) {
+    if (sample > 0xFFFF) {
+        sample = 0xFFFF;
+    }
+    if (count == 0) {
+        *average = sample;
+    } else {
+        *average += ((int32_t)sample - *average) / 4;
+    }
+}
 
-/// @brief Request value from the Atlas Scientific EZO EC
-/// @param value Pointer to a string that will hold the value, size should be
-/// fixed to 8 characters
-/// @return 0 if successful, -1 if not
-int atlas_ezo_ec_requestValue(uint8_t *value) {
-    // Read while there is still data in the buffer to flush the buffer
-    while (USART0.STATUS & USART_RXCIF_bm) {
-        uint8_t h = USART0.RXDATAH;
-        uint8_t l = USART0.RXDATAL;
+/// @brief Record the time the circuit took to boot or wake
+static void atlas_ezo_ec_recordLatency(void) {
+    atlas_ezo_ec_power_stats_t *s = &stats[ezo.woken];
+    if (ezo.timed) {
+        // Restarted after a baud rate change, the first boot counts
+        return;
     }
+    atlas_ezo_ec_average(&s->latency, millis() - ezo.poweredUp, s->count);
+    ezo.timed = 1;
+}
 
-    // Send command to request value
-    uart_sendString("R\r");
+/// @brief Record the time the circuit was awake, completing a sample
+static void atlas_ezo_ec_recordAwake(void) {
+    atlas_ezo_ec_power_stats_t *s = &stats[ezo.woken];
+    if (!ezo.timed) {
+        // It never came up, a failed boot says nothing about the policy
+        return;
+    }
+    atlas_ezo_ec_average(&s->awake, millis() - ezo.poweredUp, s->count);
+    if (s->count < 0xFFFF) {
+        s->count++;
+    }
+    ezo.timed = 0;
+}
 
-    // The expected response is x.xx\r*OK\r
-    uint8_t response[12];
-    uint8_t c;
-    uint8_t done = 0;
+/// @brief Power up the circuit: wake it when it sleeps, boot it when it is
+/// off
+/// @details Does not wait, use atlas_ezo_ec_waitForBoot
+void atlas_ezo_ec_powerUp(void) {
+    if (ezo.state == atlas_ezo_ec_sleeping) {
+        atlas_ezo_ec_wake();
+    } else if (ezo.state == atlas_ezo_ec_off) {
+        atlas_ezo_ec_enable();
+    }
+}
 
-    // Read characters from ec sensor until a carriage return is received or the
-    // buffer is full We don't know how many characters we will receive, but we
-    // have a fixed buffer size of 8, so move the characters to the end of the
-    // buffer and pad with zeros
-    uint8_t nofChars = 0;
-    char tmp[8];
-    do {
-        c = uart_read();
+/// @brief Power down the circuit until the next measurement
+/// @details With atlas_ezo_ec_power_sleep the circuit is sent to its Sleep
+/// state and stays powered, so the 3V3 rail must stay on. When that fails, or
+/// with any other policy, its power is cut.
+/// @param policy atlas_ezo_ec_power_off or atlas_ezo_ec_power_sleep
+/// @return The policy that was applied
+atlas_ezo_ec_power_t atlas_ezo_ec_powerDown(atlas_ezo_ec_power_t policy) {
+    atlas_ezo_ec_process();
+    if (policy == atlas_ezo_ec_power_sleep && ezo.state == atlas_ezo_ec_idle &&
+        atlas_ezo_ec_command_("Sleep\r") == atlas_ezo_ec_ok) {
+        atlas_ezo_ec_recordAwake();
+        uart_suspend();
+        ezo.state = atlas_ezo_ec_sleeping;
+        return atlas_ezo_ec_power_sleep;
+    }
 
-        // Store every character except a carriage return
-        if (c != 0x0D) {
-            tmp[nofChars] = c;
-            nofChars++;
-        }
-    } while ((c != 0x0D) && (nofChars < 8));
+    atlas_ezo_ec_recordAwake();
+    atlas_ezo_ec_disable();
+    return atlas_ezo_ec_power_off;
+}
 
-    // Fill value with zeros for padding
-    for (int ii = 0; ii < 8; ii++) {
-        value[ii] = 0;
+/// @brief Check if the circuit is powered, awake or sleeping
+uint8_t atlas_ezo_ec_isPowered(void) { return ezo.state != atlas_ezo_ec_off; }
+
+/// @brief Parse a conductivity reading of the Atlas Scientific EZO EC
+/// @details The EZO reports uS/cm as ASCII with a varying number of decimals
+/// ("0.00", "12.34", "1413", "50000"). The value is converted to fixed point
+/// with two decimals, further decimals are rounded. With more outputs enabled
+/// the EC comes first ("1413,706,0.70,1.000"); parsing stops at the first
+/// comma.
+/// @param str Null-terminated reading
+/// @param value Set to uS/cm * 100, ATLAS_EZO_EC_INVALID on error
+/// @return 0 if successful, -1 if the reading is empty, not a number or does
+/// not fit
+int atlas_ezo_ec_parseValue(const char *str, uint32_t *value) {
+    uint32_t v = 0;
+    uint8_t decimals = 0;
+    uint8_t digits = 0;
+    uint8_t dot = 0;
+    uint8_t round = 0;
+
+    *value = ATLAS_EZO_EC_INVALID;
+
+    for (; *str && *str != ','; str++) {
+        if (*str == '.' && !dot) {
+            dot = 1;
+            continue;
+        }
+        if (*str < '0' || *str > '9') {
+            return -1;
+        }
+        digits++;
+        if (decimals == 2) {
+            // Only the first dropped decimal matters for rounding
+            if (dot == 1) {
+                round = *str >= '5';
+                dot = 2;
+            }
+            continue;
+        }
+        if (v > (ATLAS_EZO_EC_INVALID - 10) / 10) {
+            return -1;
+        }
+        v = v * 10 + (*str - '0');
+        if (dot) {
+            decimals++;
+        }
     }
 
-    // Now lets move the received characters to the end of the buffer and pad
-    // with zeros
-    for (int ii = 0; ii < nofChars; ii++) {
-        value[8 - nofChars + ii] = tmp[ii];
+    if (digits == 0) {
+        return -1;
     }
 
-    // Read while there is still data in the buffer to flush the buffer
-    while (USART0.STATUS & USART_RXCIF_bm) {
-        uint8_t h = USART0.RXDATAH;
-        uint8_t l = USART0.RXDATAL;
+    for (; decimals < 2; decimals++) {
+        if (v > (ATLAS_EZO_EC_INVALID - 10) / 10) {
+            return -1;
+        }
+        v *= 10;
+    }
+    v += round;
+    if (v == ATLAS_EZO_EC_INVALID) {
+        return -1;
     }
 
+    *value = v;
     return 0;
 }
 
-/// @brief Disable continuous reading from the Atlas Scientific EZO EC
-/// @return 0 if successful, -1 if not
-int atlas_ezo_ec_disableContinuousReading(void) {
-    uart_sendString("C,0\r");
-    char *response = uart_readline();
-    if (strcmp(response, "*OK") == 0) {
-        return 0;
+/// @brief Finish the pending boot, command or reading
+static void atlas_ezo_ec_finish(atlas_ezo_ec_response_t response) {
+    ezo.state = atlas_ezo_ec_idle;
+    ezo.response = response;
+}
+
+/// @brief Handle a response code line (starting with '*')
+static void atlas_ezo_ec_handleCode(const char *code) {
+    if (strcmp(code, "*RE") == 0) {
+        // Ready after power on; anywhere else the pending command was lost
+        compensationKnown = 0;
+        if (ezo.state == atlas_ezo_ec_booting) {
+            atlas_ezo_ec_recordLatency();
+        }
+        atlas_ezo_ec_finish(ezo.state == atlas_ezo_ec_booting
+                                ? atlas_ezo_ec_ok
+                                : atlas_ezo_ec_reset);
+    } else if (strcmp(code, "*RS") == 0) {
+        // Reset, wait for the *RE that follows
+        ezo.state = atlas_ezo_ec_booting;
+        ezo.response = atlas_ezo_ec_reset;
+        ezo.deadline = millis() + ATLAS_EZO_EC_BOOT_TIMEOUT;
+    } else if (strcmp(code, "*WA") == 0) {
+        if (ezo.state == atlas_ezo_ec_booting) {
+            atlas_ezo_ec_recordLatency();
+        }
+        atlas_ezo_ec_finish(ezo.state == atlas_ezo_ec_booting
+                                ? atlas_ezo_ec_ok
+                                : atlas_ezo_ec_woke);
+    } else if (ezo.state == atlas_ezo_ec_command ||
+               ezo.state == atlas_ezo_ec_reading) {
+        if (strcmp(code, "*OK") == 0) {
+            if (ezo.state == atlas_ezo_ec_reading && !ezo.received) {
+                atlas_ezo_ec_finish(atlas_ezo_ec_invalid);
+            } else if (ezo.state == atlas_ezo_ec_reading &&
+                       ezo.value == ATLAS_EZO_EC_INVALID) {
+                atlas_ezo_ec_finish(atlas_ezo_ec_invalid);
+            } else {
+                atlas_ezo_ec_finish(atlas_ezo_ec_ok);
+            }
+        } else if (strcmp(code, "*SL") == 0) {
+            // Answer to Sleep
+            atlas_ezo_ec_finish(atlas_ezo_ec_ok);
+        } else if (strcmp(code, "*ER") == 0) {
+            atlas_ezo_ec_finish(atlas_ezo_ec_error);
+        } else if (strcmp(code, "*OV") == 0) {
+            atlas_ezo_ec_finish(atlas_ezo_ec_overvolt);
+        } else if (strcmp(code, "*UV") == 0) {
+            atlas_ezo_ec_finish(atlas_ezo_ec_undervolt);
+        }
     }
-    return -1;
 }
 
-/// @brief Wait for the Atlas Scientific EZO EC to boot
-/// @return 0 if successful, -1 if not
-int atlas_ezo_ec_waitForBoot(void) {
-    // Wait on ready
-    uint8_t ready = 0;
-    while (ready == 0) {
-        char *response = uart_readline();
-        if (strcmp(response, "*RE") == 0) {
-            ready = 0x01;
+/// @brief Advance the driver with the lines received so far
+/// @details Never blocks: only complete lines are read. Call it from the
+/// main loop or a wait loop until the driver is no longer busy.
+/// @return The state after processing
+atlas_ezo_ec_state_t atlas_ezo_ec_process(void) {
+    if (ezo.state == atlas_ezo_ec_off || ezo.state == atlas_ezo_ec_sleeping) {
+        return ezo.state;
+    }
+
+    while (uart_lineAvailable()) {
+        // A complete line is buffered, so this returns immediately
+        char *line = uart_readline(millis());
+        if (!line) {
+            break;
+        }
+        if (line[0] == '*') {
+            atlas_ezo_ec_handleCode(line);
+        } else if (ezo.state == atlas_ezo_ec_reading && !ezo.received) {
+            atlas_ezo_ec_parseValue(line, &ezo.value);
+            ezo.received = 1;
         }
+        // Anything else, like continuous readings while idle, is dropped
     }
 
-    if (ready == 0x01) {
-        return 0;
+    if (atlas_ezo_ec_isBusy() && (int32_t)(millis() - ezo.deadline) >= 0) {
+        if (ezo.state == atlas_ezo_ec_booting) {
+            ezo.state = atlas_ezo_ec_off;
+            ezo.response = atlas_ezo_ec_timeout;
+        } else if (ezo.state == atlas_ezo_ec_reading && ezo.received &&
+                   ezo.value != ATLAS_EZO_EC_INVALID) {
+            // The reading arrived, only its *OK is missing
+            atlas_ezo_ec_finish(atlas_ezo_ec_ok);
+        } else {
+            atlas_ezo_ec_finish(atlas_ezo_ec_timeout);
+        }
     }
-    return -1;
+
+    return ezo.state;
 }
 
-int atlas_ezo_ec_calibrate(void) {
-    // Send command to calibrate
-    uart_sendString("Cal,dry\r");
-    char *response = uart_readline();
-    if (strcmp(response, "*OK") == 0) {
-        return 0;
+/// @brief Check if the driver waits for the circuit (boot, command, reading)
+uint8_t atlas_ezo_ec_isBusy(void) {
+    return ezo.state == atlas_ezo_ec_booting ||
+           ezo.state == atlas_ezo_ec_command ||
+           ezo.state == atlas_ezo_ec_reading;
+}
+
+/// @brief Process until the driver is no longer busy, idling in between
+/// @return Outcome of the boot, command or reading that was pending
+atlas_ezo_ec_response_t atlas_ezo_ec_wait(void) {
+    while (1) {
+        atlas_ezo_ec_process();
+        if (!atlas_ezo_ec_isBusy()) {
+            return ezo.response;
+        }
+        cli();
+        if (uart_lineAvailable()) {
+            sei();
+        } else {
+            cpu_idleUntil(ezo.deadline);
+        }
+    }
+}
+
+/// @brief Outcome of the last boot, command or reading
+atlas_ezo_ec_response_t atlas_ezo_ec_response(void) { return ezo.response; }
+
+/// @brief Last reading in uS/cm * 100, ATLAS_EZO_EC_INVALID if it failed
+uint32_t atlas_ezo_ec_value(void) { return ezo.value; }
+
+/// @brief Send a command without waiting for its response code
+/// @param cmd Command including the trailing carriage return
+/// @param timeout Milliseconds to wait for the response code
+/// @return atlas_ezo_ec_ok when sent, atlas_ezo_ec_busy when the circuit is
+/// not ready for a command
+atlas_ezo_ec_response_t atlas_ezo_ec_startCommand(const char *cmd,
+                                                  uint16_t timeout) {
+    atlas_ezo_ec_process();
+    if (ezo.state != atlas_ezo_ec_idle) {
+        return atlas_ezo_ec_busy;
+    }
+
+    uart_flush();
+    uart_sendString((char *)cmd);
+    ezo.state = atlas_ezo_ec_command;
+    ezo.response = atlas_ezo_ec_busy;
+    ezo.deadline = millis() + timeout;
+    return atlas_ezo_ec_ok;
+}
+
+/// @brief Start a command that answers with a reading before its *OK
+static atlas_ezo_ec_response_t atlas_ezo_ec_startRead(const char *cmd) {
+    atlas_ezo_ec_response_t r =
+        atlas_ezo_ec_startCommand(cmd, ATLAS_EZO_EC_READ_TIMEOUT);
+    if (r == atlas_ezo_ec_ok) {
+        ezo.state = atlas_ezo_ec_reading;
+        ezo.received = 0;
+        ezo.value = ATLAS_EZO_EC_INVALID;
+    }
+    return r;
+}
+
+/// @brief Start a reading (R) with the current temperature compensation
+atlas_ezo_ec_response_t atlas_ezo_ec_startReading(void) {
+    return atlas_ezo_ec_startRead("R\r");
+}
+
+/// @brief Start a reading with temperature compensation (RT,<t>)
+/// @details Sets the compensation and takes the reading in one round trip.
+/// When the circuit already compensates for `t10` a plain R is sent instead.
+/// @param t10 Temperature in tenths of a degree Celsius
+atlas_ezo_ec_response_t atlas_ezo_ec_startCompensatedReading(int16_t t10) {
+    // RT,-1269.9\r\0 = 12 characters
+    char buf[14];
+    int16_t whole = t10 / 10;
+    uint8_t tenth = abs(t10 % 10);
+    atlas_ezo_ec_response_t r;
+
+    if (compensationKnown && compensation == t10) {
+        return atlas_ezo_ec_startReading();
+    }
+
+    sprintf(buf, "RT,%s%d.%d\r", (t10 < 0 && whole == 0) ? "-" : "", whole,
+            tenth);
+    r = atlas_ezo_ec_startRead(buf);
+    if (r == atlas_ezo_ec_ok) {
+        // Only trusted once the reading succeeds, see requestCompensatedValue
+        compensation = t10;
+        compensationKnown = 0;
+    }
+    return r;
+}
+
+/// @brief Send a command and wait for its response code
+static atlas_ezo_ec_response_t atlas_ezo_ec_command_(const char *cmd) {
+    atlas_ezo_ec_response_t r =
+        atlas_ezo_ec_startCommand(cmd, ATLAS_EZO_EC_CMD_TIMEOUT);
+    if (r != atlas_ezo_ec_ok) {
+        return r;
+    }
+    return atlas_ezo_ec_wait();
+}
+
+/// @brief Request value from the Atlas Scientific EZO EC
+/// @param value Set to the conductivity in uS/cm * 100, ATLAS_EZO_EC_INVALID
+/// if no valid reading was received
+/// @return atlas_ezo_ec_ok if successful
+atlas_ezo_ec_response_t atlas_ezo_ec_requestValue(uint32_t *value) {
+    atlas_ezo_ec_response_t r = atlas_ezo_ec_startReading();
+    if (r == atlas_ezo_ec_ok) {
+        r = atlas_ezo_ec_wait();
     }
-    return -1;
+    *value = (r == atlas_ezo_ec_ok) ? ezo.value : ATLAS_EZO_EC_INVALID;
+    return r;
 }
 
-int atlas_ezo_ec_setTemperature(uint8_t t) {
+/// @brief Request a temperature compensated value (RT) from the EZO EC
+/// @param t10 Temperature in tenths of a degree Celsius
+/// @param value Set to the conductivity in uS/cm * 100, ATLAS_EZO_EC_INVALID
+/// if no valid reading was received
+/// @return atlas_ezo_ec_ok if successful
+atlas_ezo_ec_response_t atlas_ezo_ec_requestCompensatedValue(int16_t t10,
+                                                             uint32_t *value) {
+    atlas_ezo_ec_response_t r = atlas_ezo_ec_startCompensatedReading(t10);
+    if (r == atlas_ezo_ec_ok) {
+        r = atlas_ezo_ec_wait();
+    }
+    compensationKnown = (r == atlas_ezo_ec_ok) && compensation == t10;
+    *value = (r == atlas_ezo_ec_ok) ? ezo.value : ATLAS_EZO_EC_INVALID;
+    return r;
+}
+
+/// @brief Disable continuous reading from the Atlas Scientific EZO EC
+/// @return atlas_ezo_ec_ok if successful
+atlas_ezo_ec_response_t atlas_ezo_ec_disableContinuousReading(void) {
+    return atlas_ezo_ec_command_("C,0\r");
+}
+
+/// @brief Power cycle the circuit and boot it at the current rate
+static void atlas_ezo_ec_restart(void) {
+    atlas_ezo_ec_disable();
+    delay_ms(10);
+    atlas_ezo_ec_enable();
+}
+
+/// @brief Switch the circuit to ATLAS_EZO_EC_BAUD
+/// @details The circuit answers Baud,n with *OK at the old rate, stores the
+/// new rate and restarts at it. When no *RE arrives at the new rate the
+/// circuit is turned off and the change is not retried; the next measurement
+/// boots it at the old rate, so this one does not wait for another boot.
+static void atlas_ezo_ec_negotiateBaud(void) {
+    // Baud,115200\r\0 = 13 characters
+    char buf[16];
+    uint8_t target = 0;
+    atlas_ezo_ec_response_t r;
+
+    while (target < RATE_COUNT && rates[target] != ATLAS_EZO_EC_BAUD) {
+        target++;
+    }
+    if (baudFailed || target == RATE_COUNT || target == baud) {
+        return;
+    }
+
+    sprintf(buf, "Baud,%lu\r", (unsigned long)ATLAS_EZO_EC_BAUD);
+    r = atlas_ezo_ec_command_(buf);
+    if (r != atlas_ezo_ec_ok && r != atlas_ezo_ec_timeout) {
+        // Refused, or the circuit restarted for another reason
+        baudFailed = 1;
+        return;
+    }
+
+    // A missing *OK may have been lost to the restart, listen at the new rate
+    uart_init(ATLAS_EZO_EC_BAUD);
+    ezo.state = atlas_ezo_ec_booting;
+    ezo.response = atlas_ezo_ec_busy;
+    ezo.deadline = millis() + ATLAS_EZO_EC_BOOT_TIMEOUT;
+    if (atlas_ezo_ec_wait() == atlas_ezo_ec_ok) {
+        baud = target;
+        cache.baud = baud;
+        atlas_ezo_ec_storeCache();
+        return;
+    }
+
+    baudFailed = 1;
+    atlas_ezo_ec_disable();
+    ezo.response = atlas_ezo_ec_timeout;
+}
+
+/// @brief Wait for the Atlas Scientific EZO EC to boot or wake
+/// @details A circuit that does not wake up is power cycled and booted. One
+/// that does not boot is tried at the next baud rate. Only one of these
+/// retries is made per call, and a circuit that needed one is only switched to
+/// ATLAS_EZO_EC_BAUD by the next call: the waits must stay well below the
+/// watchdog period, which is only reset between measurements.
+/// @return atlas_ezo_ec_ok if successful, atlas_ezo_ec_timeout if no *RE
+/// arrived within ATLAS_EZO_EC_BOOT_TIMEOUT of atlas_ezo_ec_enable
+atlas_ezo_ec_response_t atlas_ezo_ec_waitForBoot(void) {
+    atlas_ezo_ec_response_t r = atlas_ezo_ec_wait();
+    uint8_t retried = (r == atlas_ezo_ec_timeout);
+
+    if (r == atlas_ezo_ec_timeout && ezo.woken) {
+        // No *WA: the circuit hung or lost its power while asleep, boot it
+        atlas_ezo_ec_restart();
+        r = atlas_ezo_ec_wait();
+    } else if (r == atlas_ezo_ec_timeout) {
+        // No *RE: perhaps a swapped circuit talking at another rate. Boot it
+        // once more at the next rate; the rates after that are tried by the
+        // next measurements, which keeps a dead circuit from taking long.
+        baud = (baud + 1) % RATE_COUNT;
+        atlas_ezo_ec_restart();
+        r = atlas_ezo_ec_wait();
+    }
+    if (r == atlas_ezo_ec_ok) {
+        if (cache.baud != baud) {
+            cache.baud = baud;
+            atlas_ezo_ec_storeCache();
+        }
+        if (!retried) {
+            atlas_ezo_ec_negotiateBaud();
+        }
+        r = (ezo.state == atlas_ezo_ec_idle) ? atlas_ezo_ec_ok : ezo.response;
+    }
+    return r;
+}
+
+atlas_ezo_ec_response_t atlas_ezo_ec_calibrate(void) {
+    // Send command to calibrate
+    return atlas_ezo_ec_command_("Cal,dry\r");
+}
+
+atlas_ezo_ec_response_t atlas_ezo_ec_setTemperature(uint8_t t) {
     // T,255\r\0   = 7 characters
-    static char buf[10];
+    char buf[10];
     sprintf(buf, "T,%d\r", t);
-    uart_sendString(buf);
-    char *response = uart_readline();
-    if (strcmp(response, "*OK") == 0) {
+    return atlas_ezo_ec_command_(buf);
+}
+
+
+/// @brief Get the desired settings
+void atlas_ezo_ec_getSettings(atlas_ezo_ec_settings_t *settings) {
+    *settings = cache.desired;
+}
+
+/// @brief Set and store the desired settings
+/// @details They are sent to the circuit by the next atlas_ezo_ec_applySettings
+/// @return 0 if successful, -1 if a setting is out of range
+int atlas_ezo_ec_setSettings(const atlas_ezo_ec_settings_t *settings) {
+    if (settings->k < 10 || settings->k > 1000 || settings->led > 1) {
+        return -1;
+    }
+    cache.desired = *settings;
+    atlas_ezo_ec_storeCache();
+    return 0;
+}
+
+/// @brief Forget what the circuit is known to have stored
+/// @details Use after swapping the circuit; the next atlas_ezo_ec_applySettings
+/// sends every setting again
+void atlas_ezo_ec_forgetSettings(void) {
+    cache.known = 0;
+    compensationKnown = 0;
+    atlas_ezo_ec_storeCache();
+}
+
+/// @brief Send a setting command and track its outcome in the cache
+static atlas_ezo_ec_response_t atlas_ezo_ec_applySetting(const char *cmd,
+                                                         uint8_t setting) {
+    atlas_ezo_ec_response_t r = atlas_ezo_ec_command_(cmd);
+    if (r == atlas_ezo_ec_ok) {
+        cache.known |= setting;
+    } else {
+        // The command may or may not have been stored
+        cache.known &= ~setting;
+    }
+    return r;
+}
+
+/// @brief Bring the settings of the circuit in line with the desired ones
+/// @details The EZO stores these settings itself, so each command is only
+/// sent when the cache does not know the circuit to have the desired value.
+/// Once everything was applied, a wake costs no commands at all.
+/// @return atlas_ezo_ec_ok if the circuit has all desired settings, otherwise
+/// the response of the first command that failed
+atlas_ezo_ec_response_t atlas_ezo_ec_applySettings(void) {
+    static const char *const outputs[] = {"O,EC,1\r", "O,TDS,0\r", "O,S,0\r",
+                                          "O,SG,0\r"};
+    // K,10.00\r\0 = 9 characters
+    char buf[12];
+    atlas_ezo_ec_response_t r = atlas_ezo_ec_ok;
+
+    if (!(cache.known & SETTING_CONTINUOUS)) {
+        r = atlas_ezo_ec_applySetting("C,0\r", SETTING_CONTINUOUS);
+    }
+
+    if (r == atlas_ezo_ec_ok && !(cache.known & SETTING_OUTPUTS)) {
+        for (uint8_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); i++) {
+            r = atlas_ezo_ec_applySetting(outputs[i], SETTING_OUTPUTS);
+            if (r != atlas_ezo_ec_ok) {
+                break;
+            }
+        }
+    }
+
+    if (r == atlas_ezo_ec_ok &&
+        (!(cache.known & SETTING_K) || cache.applied.k != cache.desired.k)) {
+        sprintf(buf, "K,%u.%02u\r", cache.desired.k / 100,
+                cache.desired.k % 100);
+        r = atlas_ezo_ec_applySetting(buf, SETTING_K);
+        cache.applied.k = cache.desired.k;
+    }
+
+    if (r == atlas_ezo_ec_ok && (!(cache.known & SETTING_LED) ||
+                                 cache.applied.led != cache.desired.led)) {
+        r = atlas_ezo_ec_applySetting(cache.desired.led ? "L,1\r" : "L,0\r",
+                                      SETTING_LED);
+        cache.applied.led = cache.desired.led;
+    }
+
+    atlas_ezo_ec_storeCache();
+    return r;
+}
+
+/// @brief Measured cost of a power policy
+/// @param policy atlas_ezo_ec_power_off or atlas_ezo_ec_power_sleep
+const atlas_ezo_ec_power_stats_t *
+atlas_ezo_ec_powerStats(atlas_ezo_ec_power_t policy) {
+    return &stats[policy == atlas_ezo_ec_power_sleep];
+}
+
+/// @brief Estimate the energy a power policy costs per sample
+/// @details Uses the measured awake time of the policy and the estimated
+/// ATLAS_EZO_EC_ACTIVE_CURRENT and ATLAS_EZO_EC_SLEEP_CURRENT at 3.3 V. The
+/// sleep policy also pays the sleep current for the rest of the period.
+/// @param policy atlas_ezo_ec_power_off or atlas_ezo_ec_power_sleep
+/// @param period Time between samples in ms
+/// @return Energy in uJ, 0 when the policy was not measured yet
+uint32_t atlas_ezo_ec_powerEnergy(atlas_ezo_ec_power_t policy,
+                                  uint32_t period) {
+    const atlas_ezo_ec_power_stats_t *s = atlas_ezo_ec_powerStats(policy);
+    uint32_t charge; // uC
+
+    if (s->count == 0) {
         return 0;
     }
-    return -1;
+    charge = (ATLAS_EZO_EC_ACTIVE_CURRENT / 10) * (uint32_t)s->awake / 100;
+    if (policy == atlas_ezo_ec_power_sleep && period > s->awake) {
+        charge += ATLAS_EZO_EC_SLEEP_CURRENT * ((period - s->awake) / 1000);
+    }
+    return charge * 33 / 10;
+}
+
+/// @brief Choose the power policy for a sample period
+/// @details Each policy is used for ATLAS_EZO_EC_POWER_MIN_SAMPLES first so
+/// its cost is known, then the one with the lowest energy per sample wins.
+/// Measurements on request have no period and always cut the power.
+/// @param period Time between samples in ms, 0 when unknown
+atlas_ezo_ec_power_t atlas_ezo_ec_choosePower(uint32_t period) {
+    if (period == 0) {
+        return atlas_ezo_ec_power_off;
+    }
+    if (stats[0].count < ATLAS_EZO_EC_POWER_MIN_SAMPLES) {
+        return atlas_ezo_ec_power_off;
+    }
+    if (stats[1].count < ATLAS_EZO_EC_POWER_MIN_SAMPLES) {
+        return atlas_ezo_ec_power_sleep;
+    }
+    return atlas_ezo_ec_powerEnergy(atlas_ezo_ec_power_sleep, period) <
+                   atlas_ezo_ec_powerEnergy(atlas_ezo_ec_power_off, period)
+               ? atlas_ezo_ec_power_sleep
+               : atlas_ezo_ec_power_off;
 }
@@ -2,26 +2,57 @@
 #include "../../include/drivers/onewire.h"
 #include "../../include/mcu/util.h"
 
-#define ERROR_VALUE 100
-#define MAX_RETRIES 5
+#include <avr/interrupt.h>
+#include <string.h>
 
-void convert_t(uint8_t id) {
-  ow_reset();
+/// @brief ROM codes of the DS18B20s on the bus, in search order
+static uint8_t roms[DS18B20_MAX_DEVICES][OW_ROM_LENGTH];
+static uint8_t device_count = 0;
+
+/// @brief Address a single sensor
+/// @details A sensor alone on the bus is addressed with SKIP ROM, which saves
+/// sending its 8 byte ROM code
+/// @return 0 if a sensor answered the reset, -1 if not
+static int8_t select_device(uint8_t id) {
+  if (device_count > 1)
+    return ow_select(roms[id]);
+  if (ow_reset())
+    return -1;
   ow_write(OW_CMD_SKIP);
-  ow_write(DS18B20_CONVERT);
+  return 0;
 }
 
-uint16_t read_temp() {
-  ow_reset();
+/// @brief Start a conversion on all sensors at once
+/// @return 0 if a sensor answered the reset, -1 if not
+int8_t convert_t(void) {
+  if (ow_reset())
+    return -1;
   ow_write(OW_CMD_SKIP);
-  ow_write(DS18B20_READ_SCRATCHPAD);
-
-  uint8_t lsb = ow_read();
-  uint8_t msb = ow_read();
+  ow_write(DS18B20_CONVERT);
+  return 0;
+}
 
-  return ((uint16_t)msb << 8) | (uint16_t)lsb;
+/// @brief Read the full scratchpad of a sensor
+/// @details Besides the CRC the fixed bits are checked: a bus held low reads
+/// as all zeros, which has a valid CRC
+/// @param buf Set to the DS18B20_SCRATCHPAD_LENGTH scratchpad bytes
+/// @return 0 if successful, -1 if the sensor did not answer, -2 if the
+/// scratchpad is corrupted
+static int8_t read_scratchpad(uint8_t id, uint8_t *buf) {
+  if (select_device(id))
+    return -1;
+  ow_write(DS18B20_READ_SCRATCHPAD);
+  for (uint8_t i = 0; i < DS18B20_SCRATCHPAD_LENGTH; i++)
+    buf[i] = ow_read();
+  if (ow_crc8(buf, DS18B20_SCRATCHPAD_LENGTH) != 0)
+    return -2;
+  // Configuration: bit 7 is 0 and bits 4..0 are 1; bytes 5 and 7 are fixed
+  if ((buf[4] & 0x9f) != 0x1f || buf[5] != 0xff || buf[7] != 0x10)
+    return -2;
+  return 0;
 }
 
+/// @brief Write the resolution to all sensors
 void set_resolution(uint8_t res) {
   ow_reset();
   ow_write(OW_CMD_SKIP);
@@ -31,68 +62,165 @@ void set_resolution(uint8_t res) {
   ow_write(res << 5);
 }
 
-float get_res_bit(uint8_t res) {
-  switch (res) {
-  case DS18B20_RES_12:
-    return 0.0625;
-  case DS18B20_RES_11:
-    return 0.125;
-  case DS18B20_RES_10:
-    return 0.25;
-  case DS18B20_RES_9:
-    return 0.5;
+/// @brief Find the DS18B20s on the bus
+/// @details The ROM codes are cached, sensors are addressed by their index
+/// in the table from then on. Other 1-Wire devices are skipped.
+/// @return Number of sensors found, at most DS18B20_MAX_DEVICES
+uint8_t ds18b20_scan(void) {
+  ow_search_t search;
+
+  device_count = 0;
+  ow_searchInit(&search);
+  while (device_count < DS18B20_MAX_DEVICES && ow_searchNext(&search)) {
+    if (search.rom[0] == DS18B20_FAMILY_CODE)
+      memcpy(roms[device_count++], search.rom, OW_ROM_LENGTH);
   }
-  return 0.0625;
+  return device_count;
 }
 
-void wait_convert(uint8_t res) {
+/// @brief Number of sensors found by the last scan
+uint8_t ds18b20_count(void) { return device_count; }
+
+/// @brief Find the sensors and make sure they convert at the resolution of
+/// `d`
+/// @details Reads the configuration register of every sensor and only when
+/// one differs writes the resolution and copies it to the sensor EEPROMs.
+/// The sensors then power up with it every time the 3V3 rail is switched on,
+/// so this is done once and not written again.
+/// @return 0 if successful, -1 if no sensor answered
+static int8_t configure(ds18b20_t *d) {
+  uint8_t scratchpad[DS18B20_SCRATCHPAD_LENGTH];
+  uint8_t update = 0;
+
+  if (ds18b20_scan() == 0)
+    return -1;
+
+  for (uint8_t id = 0; id < device_count; id++) {
+    if (read_scratchpad(id, scratchpad) ||
+        ((scratchpad[4] >> 5) & 0x03) != d->resolution)
+      update = 1;
+  }
+
+  if (update) {
+    set_resolution(d->resolution);
+    ow_reset();
+    ow_write(OW_CMD_SKIP);
+    ow_write(DS18B20_COPY_SCRATCHPAD);
+    delay_ms(DS18B20_COPY_TIME);
+  }
+
+  d->configured = 1;
+  return 0;
+}
+
+uint16_t get_convert_time(uint8_t res) {
   switch (res) {
   case DS18B20_RES_12:
-    delay_ms(750);
-    break;
+    return 750;
   case DS18B20_RES_11:
-    delay_ms(375);
-    break;
+    return 375;
   case DS18B20_RES_10:
-    delay_ms(188);
-    break;
+    return 188;
   case DS18B20_RES_9:
-    delay_ms(94);
-    break;
+    return 94;
+  }
+  return 750;
+}
+
+/// @brief Start a temperature conversion on all sensors without waiting for it
+/// @details The conversion runs in the sensors while the caller does other
+/// work; ds18b20_poll tells when they are done and ds18b20_fetch reads the
+/// result of each. The sensors are found and configured on the first start.
+/// @param id Not used, all sensors convert at once
+/// @return 0 if started, -1 if no sensor answered
+int8_t ds18b20_startConversion(ds18b20_t *d, uint8_t id) {
+  if ((!d->configured && configure(d) != 0) || convert_t() != 0) {
+    d->state = ds18b20_error;
+    return -1;
   }
+  d->convert_start = millis();
+  // Polling a conversion that cannot be done yet only costs wakeups
+  d->next_poll = d->convert_start + get_convert_time(d->resolution) / 2;
+  d->state = ds18b20_converting;
+  return 0;
 }
 
-float ds18b20_read(ds18b20_t *d, uint8_t id) {
-  set_resolution(d->resolution);
-  //  Read a new tempetarutre which is set in the scratchpad
-  convert_t(id);
+/// @brief Check if the running conversion is done
+/// @details Never blocks: the bus is only sampled once `next_poll` has
+/// passed, then the sensor answers a read slot with 1 once it is done. Until
+/// then polls are scheduled every DS18B20_POLL_INTERVAL.
+/// @return The state of the conversion
+ds18b20_state_t ds18b20_poll(ds18b20_t *d) {
+  uint32_t now = millis();
 
-  wait_convert(d->resolution);
-  // delay_ms(750);
+  if (d->state != ds18b20_converting || (int32_t)(now - d->next_poll) < 0)
+    return d->state;
 
-  uint32_t start = millis();
-  uint32_t now = start;
-  do {
-    delay_ms(20);
-    now = millis();
-    if (now - start > 1000)
-      return ERROR_VALUE;
-  } while (!ow_readBit());
-
-  // Read scratchpad to get temperature bytes
-  // sometimes read_temp returns 0xffff, so we retry up to `MAX_RETRIES` times
+  if (ow_readBit())
+    d->state = ds18b20_ready;
+  else if (now - d->convert_start >
+           get_convert_time(d->resolution) + DS18B20_POLL_TIMEOUT)
+    d->state = ds18b20_error;
+  else
+    d->next_poll = now + DS18B20_POLL_INTERVAL;
+  return d->state;
+}
+
+/// @brief Read the temperature of a sensor after a finished conversion
+/// @details Can be called for every sensor until the next conversion starts.
+/// A bad read only repeats the scratchpad read, up to DS18B20_READ_RETRIES
+/// times, never the conversion. A sensor that keeps failing makes the next
+/// start scan the bus again. The reason of a failure is left in d->error.
+/// @param id Index of the sensor, below ds18b20_count()
+/// @return Temperature in centidegrees Celsius or DS18B20_ERROR_VALUE
+int16_t ds18b20_fetch(ds18b20_t *d, uint8_t id) {
+  uint8_t scratchpad[DS18B20_SCRATCHPAD_LENGTH];
   uint8_t retries = 0;
-  uint16_t raw;
+  int8_t r;
+
+  d->error = ds18b20_err_absent;
+  if (d->state != ds18b20_ready || id >= device_count)
+    return DS18B20_ERROR_VALUE;
+
   do {
-    raw = read_temp();
-    retries++;
-    if (retries > MAX_RETRIES) {
-      return ERROR_VALUE;
-    }
-  } while (raw == 0xffff);
-
-  // Convert
-  uint8_t sign = raw >> 15;
-  float temp = (float)(raw & 0x7FFF) * get_res_bit(d->resolution);
-  return temp * (sign ? -1 : 1);
+    r = read_scratchpad(id, scratchpad);
+  } while (r != 0 && retries++ < DS18B20_READ_RETRIES);
+  if (r != 0) {
+    d->error = (r == -1) ? ds18b20_err_absent : ds18b20_err_crc;
+    d->configured = 0;
+    return DS18B20_ERROR_VALUE;
+  }
+
+  int16_t raw = (int16_t)(((uint16_t)scratchpad[1] << 8) | scratchpad[0]);
+  if (raw == DS18B20_POWER_ON_VALUE) {
+    d->error = ds18b20_err_power_on;
+    return DS18B20_ERROR_VALUE;
+  }
+  d->error = ds18b20_err_none;
+
+  // The register is two's complement in 1/16 degrees, the low bits are
+  // undefined below 12 bit resolution
+  raw &= (int16_t)(0xFFFF << (DS18B20_RES_12 - d->resolution));
+  // 100 / 16 = 6.25; the shift is arithmetic, so this rounds down for
+  // negative temperatures too
+  return raw * 6 + (raw >> 2);
+}
+
+/// @brief Wait for the conversion started by ds18b20_startConversion and read
+/// the temperature
+/// @details Sleeps until each scheduled poll, so it returns as soon as the
+/// sensors are done instead of after the worst-case conversion time
+/// @return Temperature in centidegrees Celsius or DS18B20_ERROR_VALUE
+int16_t ds18b20_readConversion(ds18b20_t *d, uint8_t id) {
+  while (ds18b20_poll(d) == ds18b20_converting) {
+    cli();
+    cpu_sleepUntil(d->next_poll);
+  }
+  return ds18b20_fetch(d, id);
+}
+
+/// @brief Start a conversion and wait for the result
+int16_t ds18b20_read(ds18b20_t *d, uint8_t id) {
+  ds18b20_startConversion(d, id);
+  return ds18b20_readConversion(d, id);
 }
@@ -6,6 +6,7 @@
 #include "drivers/zacwire.h"
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <string.h>
 
 // struct huba713_t huba713_config;
 
@@ -13,21 +14,126 @@ void huba713_init(void) { zacwire_init(); }
 
 /// @brief Read a pressure and temperature (3-bytes total) from the bus
 /// @details Read a pressure and temperature (3-bytes total) from the (32kHz)
-/// bus
+/// bus. The outputs are only written for a valid frame.
 /// @param pressure pointer to the pressure data
-/// @param temperature pointer to the temperature data
-/// @return validity of the data: 0x00 if valid, 0xFF if invalid
-uint8_t huba713_read(uint16_t *pressure, float *temperature) {
+/// @param temperature pointer to the temperature data, in centidegrees Celsius
+/// @return 0 if valid, otherwise the ZACWIRE_ERR_* of the frame
+int8_t huba713_read(uint16_t *pressure, int16_t *temperature) {
     // Note, 1-wire for this Huba pressure sensor is 32kHz, so 31.3us periode
-    // Wait for the bus to become idle
+    uint8_t buf[3];
 
-    uint8_t buf[3] = {0};
-    // The bus is idle, wait for start
-
-    int err = zacwire_read(buf, 3);
+    int8_t err = zacwire_read(buf, 3);
+    if (err) {
+        return err;
+    }
 
     *pressure = (buf[0] << 8) | buf[1];
-    *temperature = (0.784 * (float)buf[2]) - 50;
+    // 0.784 * t - 50 degrees; 78.4 = 78 + 2 / 5 centidegrees per count
+    *temperature = (int16_t)(buf[2] * 78U + buf[2] * 2U / 5) - 5000;
+
+    return 0;
+}
+
+/// @brief Compare and exchange frame i and j, keyed on pressure
+/// @details The temperature moves along with its pressure, so both medians
+/// come from the same frame
+static inline void huba713_cswap(uint16_t *pressure, int16_t *temperature,
+                                 uint8_t i, uint8_t j) {
+    if (pressure[i] > pressure[j]) {
+        uint16_t p = pressure[i];
+        int16_t t = temperature[i];
+        pressure[i] = pressure[j];
+        temperature[i] = temperature[j];
+        pressure[j] = p;
+        temperature[j] = t;
+    }
+}
+
+/// @brief Sort a full window with Batcher's odd-even merge network
+/// @details The comparators only depend on HUBA_MEDIAN_COUNT, so all loop
+/// bounds are compile-time constants and the number of comparisons does not
+/// depend on the data (38 comparators for 11 samples, against up to 55
+/// compare-and-shift steps for insertion sort)
+static void huba713_network(uint16_t *pressure, int16_t *temperature) {
+    const uint8_t n = HUBA_MEDIAN_COUNT;
+    for (uint8_t p = 1; p < n; p <<= 1) {
+        for (uint8_t k = p; k >= 1; k >>= 1) {
+            for (uint8_t j = k % p; j + k < n; j += 2 * k) {
+                for (uint8_t i = 0; i < k && i + j + k < n; i++) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                        huba713_cswap(pressure, temperature, i + j, i + j + k);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// @brief Sort pressures in place with insertion sort
+static void huba713_sort(uint16_t *v, uint8_t n) {
+    for (uint8_t i = 1; i < n; i++) {
+        uint16_t p = v[i];
+        uint8_t j;
+
+        for (j = i; j > 0 && v[j - 1] > p; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = p;
+    }
+}
+
+/// @brief Sort a partial window (frames were dropped) with insertion sort,
+/// keyed on pressure
+static void huba713_insertion(uint16_t *pressure, int16_t *temperature,
+                              uint8_t n) {
+    for (uint8_t i = 1; i < n; i++) {
+        uint16_t p = pressure[i];
+        int16_t t = temperature[i];
+        uint8_t j;
+
+        for (j = i; j > 0 && pressure[j - 1] > p; j--) {
+            pressure[j] = pressure[j - 1];
+            temperature[j] = temperature[j - 1];
+        }
+        pressure[j] = p;
+        temperature[j] = t;
+    }
+}
+
+/// @brief Median of the sampled pressure and temperature
+/// @details Sorts the frames in place by pressure, each temperature staying
+/// with its pressure; the median frame is left at index n / 2.
+/// A full window of HUBA_MEDIAN_COUNT samples goes through a fixed sorting
+/// network, fewer samples (after read errors) through insertion sort.
+/// @param pressure Pressure samples
+/// @param temperature Temperature samples
+/// @param n Number of samples in both arrays, at most HUBA_MEDIAN_COUNT
+void huba713_median(uint16_t *pressure, int16_t *temperature, uint8_t n) {
+    if (n == HUBA_MEDIAN_COUNT) {
+        huba713_network(pressure, temperature);
+    } else {
+        huba713_insertion(pressure, temperature, n);
+    }
+}
+
+/// @brief Median absolute deviation of the sampled pressure
+/// @details Unlike the standard deviation a single outlier frame barely moves
+/// it, so it measures how well the window agrees rather than how bad its worst
+/// frame is. Leaves the samples untouched.
+/// @param pressure Pressure samples
+/// @param n Number of samples, 1 to HUBA_MEDIAN_COUNT
+/// @return MAD in pressure counts
+uint16_t huba713_mad(const uint16_t *pressure, uint8_t n) {
+    uint16_t v[HUBA_MEDIAN_COUNT];
+
+    memcpy(v, pressure, n * sizeof(uint16_t));
+    huba713_sort(v, n);
+
+    uint16_t median = v[n / 2];
+    for (uint8_t i = 0; i < n; i++) {
+        v[i] = (v[i] > median) ? v[i] - median : median - v[i];
+    }
+    huba713_sort(v, n);
 
-    return err;
+    return v[n / 2];
 }